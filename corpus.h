@@ -0,0 +1,128 @@
+#pragma once
+
+// Binary instance corpus written by corpus.py, read in place from an mmap
+// so that worker processes share the page cache. All little-endian:
+//
+//   file:      "RBC1", uint32 count, uint64 offset[count] (from file start)
+//   instance:  uint16 w, uint16 h, uint8 num_colors, uint8 0, uint16 0,
+//              uint32 seed, start cells, target cells
+//
+// Cells are row by row, two per byte, low nibble first: 0-9 for balls,
+// 10 for empty, 11 for wall. Each board takes (w * h + 1) / 2 bytes.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+class InstanceCorpus {
+public:
+    class Instance {
+    public:
+        int w, h;
+        int num_colors;
+        uint32_t seed;
+
+        // board is 0 for start, 1 for target
+        char cell(int board, int x, int y) const {
+            const uint8_t *packed = cells + board * ((w * h + 1) / 2);
+            int i = y * w + x;
+            int nibble = packed[i / 2] >> (i % 2 * 4) & 15;
+            if (nibble < 10)
+                return '0' + nibble;
+            return nibble == 10 ? '.' : '#';
+        }
+
+        // As read from the tester.
+        std::vector<std::string> rows(int board) const {
+            std::vector<std::string> result(h, std::string(w, ' '));
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    result[y][x] = cell(board, x, y);
+            return result;
+        }
+
+    private:
+        friend class InstanceCorpus;
+        const uint8_t *cells;
+    };
+
+    // Exits with a message if the file can't be mapped or isn't a corpus.
+    explicit InstanceCorpus(const std::string &path) : path(path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            fail("can't open");
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            fail("can't stat");
+        }
+        length = st.st_size;
+        if (length < 8) {
+            close(fd);
+            fail("too short");
+        }
+        void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            fail("can't mmap");
+        data = static_cast<const uint8_t*>(p);
+        if (memcmp(data, "RBC1", 4) != 0)
+            fail("not a corpus");
+        count = read<uint32_t>(4);
+        if (8 + 8 * uint64_t(count) > length)
+            fail("truncated offset table");
+    }
+    ~InstanceCorpus() {
+        munmap(const_cast<uint8_t*>(data), length);
+    }
+    InstanceCorpus(const InstanceCorpus&) = delete;
+    InstanceCorpus& operator=(const InstanceCorpus&) = delete;
+
+    int size() const { return count; }
+
+    // Exits with a message if i is out of range or the instance is cut off.
+    Instance operator[](int i) const {
+        if (i < 0 || i >= count)
+            fail(("no instance " + std::to_string(i) + " of " +
+                  std::to_string(count)).c_str());
+        size_t offset = read<uint64_t>(8 + 8 * i);
+        if (offset > length || length - offset < 12)
+            fail("truncated instance header");
+        Instance instance;
+        instance.w = read<uint16_t>(offset);
+        instance.h = read<uint16_t>(offset + 2);
+        instance.num_colors = data[offset + 4];
+        instance.seed = read<uint32_t>(offset + 8);
+        instance.cells = data + offset + 12;
+        if (length - offset - 12 <
+                uint64_t(instance.w * instance.h + 1) / 2 * 2)
+            fail("truncated instance");
+        return instance;
+    }
+
+private:
+    std::string path;
+    const uint8_t *data;
+    size_t length;
+    int count;
+
+    [[noreturn]] void fail(const char *message) const {
+        fprintf(stderr, "%s: %s\n", path.c_str(), message);
+        exit(1);
+    }
+
+    template<class T>
+    T read(size_t offset) const {
+        T result;
+        memcpy(&result, data + offset, sizeof(T));
+        return result;
+    }
+};
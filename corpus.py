@@ -0,0 +1,158 @@
+"""
+Binary instance corpus (format in corpus.h): many boards in one file that
+main reads with --corpus=FILE --instance=N through mmap, without parsing.
+
+    python3 corpus.py build OUT [--count 1000] [--first_seed 1000]
+    python3 corpus.py pack OUT INPUT...   (tester-format text files)
+    python3 corpus.py show FILE [INDEX]
+"""
+
+import argparse
+import mmap
+import random
+import struct
+import sys
+
+import scaling
+
+
+MAGIC = b'RBC1'
+EMPTY = 10
+WALL = 11
+
+
+def random_instance(seed):
+    """Board text with tester-like size and densities."""
+    rnd = random.Random(seed)
+    return scaling.generate(
+        rnd.randint(10, 60), rnd.uniform(0.05, 0.3), rnd.uniform(0.05, 0.3),
+        rnd.randint(1, 10), seed)
+
+
+def parse_text(text):
+    """Tester format to (start rows, target rows)."""
+    tokens = text.split()
+    h = int(tokens[0])
+    start = tokens[1:1 + h]
+    assert int(tokens[1 + h]) == h
+    target = tokens[2 + h:2 + 2 * h]
+    return start, target
+
+
+def pack_board(rows):
+    nibbles = []
+    for row in rows:
+        for c in row:
+            nibbles.append(EMPTY if c == '.' else WALL if c == '#' else int(c))
+    if len(nibbles) % 2:
+        nibbles.append(0)
+    return bytes(
+        nibbles[i] | nibbles[i + 1] << 4 for i in range(0, len(nibbles), 2))
+
+
+def unpack_board(data, w, h):
+    rows = []
+    for y in range(h):
+        row = []
+        for x in range(w):
+            i = y * w + x
+            nibble = data[i // 2] >> (i % 2 * 4) & 15
+            row.append(
+                '.' if nibble == EMPTY else '#' if nibble == WALL
+                else str(nibble))
+        rows.append(''.join(row))
+    return rows
+
+
+def write(path, instances):
+    """instances are (seed, board text)."""
+    blobs = []
+    for seed, text in instances:
+        start, target = parse_text(text)
+        h, w = len(start), len(start[0])
+        colors = {c for row in start for c in row if c.isdigit()}
+        blobs.append(
+            struct.pack('<HHBBHI', w, h, len(colors), 0, 0, seed) +
+            pack_board(start) + pack_board(target))
+
+    offset = 8 + 8 * len(blobs)
+    offsets = []
+    for blob in blobs:
+        offsets.append(offset)
+        offset += len(blob)
+    with open(path, 'wb') as fout:
+        fout.write(MAGIC + struct.pack('<I', len(blobs)))
+        fout.write(struct.pack('<{}Q'.format(len(blobs)), *offsets))
+        for blob in blobs:
+            fout.write(blob)
+
+
+class Corpus(object):
+    def __init__(self, path):
+        with open(path, 'rb') as fin:
+            self.data = mmap.mmap(fin.fileno(), 0, access=mmap.ACCESS_READ)
+        assert self.data[:4] == MAGIC
+        self.count, = struct.unpack_from('<I', self.data, 4)
+
+    def __len__(self):
+        return self.count
+
+    def header(self, i):
+        offset, = struct.unpack_from('<Q', self.data, 8 + 8 * i)
+        w, h, num_colors, _, _, seed = struct.unpack_from(
+            '<HHBBHI', self.data, offset)
+        return dict(
+            w=w, h=h, num_colors=num_colors, seed=seed, offset=offset + 12)
+
+    def text(self, i):
+        header = self.header(i)
+        w, h = header['w'], header['h']
+        size = (w * h + 1) // 2
+        start = unpack_board(self.data[header['offset']:], w, h)
+        target = unpack_board(self.data[header['offset'] + size:], w, h)
+        lines = [str(h)] + start + [str(h)] + target
+        return '\n'.join(lines) + '\n'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    subparsers = parser.add_subparsers(dest='command')
+
+    build = subparsers.add_parser('build', help='random tester-like boards')
+    build.add_argument('out')
+    build.add_argument('--count', type=int, default=1000)
+    build.add_argument('--first_seed', type=int, default=1000)
+
+    pack = subparsers.add_parser('pack', help='tester-format text files')
+    pack.add_argument('out')
+    pack.add_argument('inputs', nargs='+')
+
+    show = subparsers.add_parser('show')
+    show.add_argument('file')
+    show.add_argument('index', type=int, nargs='?')
+
+    args = parser.parse_args()
+    if args.command == 'build':
+        seeds = range(args.first_seed, args.first_seed + args.count)
+        write(args.out, [(seed, random_instance(seed)) for seed in seeds])
+    elif args.command == 'pack':
+        instances = []
+        for i, path in enumerate(args.inputs):
+            with open(path) as fin:
+                instances.append((i, fin.read()))
+        write(args.out, instances)
+    elif args.command == 'show':
+        corpus = Corpus(args.file)
+        if args.index is None:
+            for i in range(len(corpus)):
+                header = corpus.header(i)
+                print('{:5} seed {seed:10}  {w}x{h}  {num_colors} colors'
+                      .format(i, **header))
+        else:
+            sys.stdout.write(corpus.text(args.index))
+    else:
+        parser.print_help()
+
+
+if __name__ == '__main__':
+    main()
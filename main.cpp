@@ -4,19 +4,68 @@
 #include <cassert>
 #include <chrono>
 #include <thread>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
 #define LOCAL
+#ifndef NO_DRAW_BOARDS
 #define DRAW_BOARDS
+#endif
 
 // 'cause topcoder requires single file submission
 #include "solution.cpp"
 
+#include "corpus.h"
+
+
+// Killed by the tester, failed assert or watchdog: print what we have.
+void flush_checkpoint_and_exit(int sig) {
+    checkpoint.flush(STDOUT_FILENO);
+    if (sig == SIGABRT) {
+        // still dump core (see driver.sh)
+        signal(SIGABRT, SIG_DFL);
+        abort();
+    }
+    _exit(0);
+}
+
+
+// Appends captured subproblems to $SUBPROBLEM_CORPUS (subproblems.txt by
+// default) in one write, so that parallel runs don't interleave records.
+void save_subproblem_corpus() {
+    string text = subproblem_corpus.get_text();
+    if (text.empty())
+        return;
+    const char *path = getenv("SUBPROBLEM_CORPUS");
+    if (path == nullptr)
+        path = "subproblems.txt";
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0 || write(fd, text.data(), text.size()) != text.size())
+        cerr << "can't save subproblems to " << path << endl;
+    if (fd >= 0)
+        close(fd);
+}
+
 
 int main(int argc, char **argv) {
+    // --corpus=FILE --instance=N to read the board from a corpus.py file
+    // instead of stdin
+    string corpus_path;
+    int instance_index = 0;
     vector<string> args(argv + 1, argv + argc);
     for (auto arg : args) {
+        if (arg.compare(0, 9, "--corpus=") == 0) {
+            corpus_path = arg.substr(9);
+            continue;
+        }
+        if (arg.compare(0, 11, "--instance=") == 0) {
+            instance_index = stoi(arg.substr(11));
+            continue;
+        }
         int pos = arg.find('=');
         assert(pos != string::npos);
         auto key = arg.substr(0, pos);
@@ -25,33 +74,59 @@ int main(int argc, char **argv) {
         assert(custom_knobs.count(key) == 0);
         custom_knobs[key] = value;
     }
+    // the submission runs without the profiler
+    if (custom_knobs.count("profile_us") == 0)
+        custom_knobs["profile_us"] = 1000;
+
+    signal(SIGTERM, flush_checkpoint_and_exit);
+    signal(SIGINT, flush_checkpoint_and_exit);
+    signal(SIGABRT, flush_checkpoint_and_exit);
+
+    int watchdog_ms = custom_knobs.count("watchdog_ms") ?
+        custom_knobs["watchdog_ms"] : knobs.at("watchdog_ms");
+    if (watchdog_ms > 0) {
+        thread([watchdog_ms]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(watchdog_ms));
+            cerr << "WATCHDOG" << endl;
+            flush_checkpoint_and_exit(0);
+        }).detach();
+    }
 
-    int H;
-    cin >> H;
+    vector<string> start;
+    vector<string> target;
+    if (!corpus_path.empty()) {
+        InstanceCorpus corpus(corpus_path);
+        auto instance = corpus[instance_index];
+        cerr << "# instance_seed = " << instance.seed << endl;
+        start = instance.rows(0);
+        target = instance.rows(1);
+    } else {
+        int H;
+        cin >> H;
 
-    vector<string> start(H);
-    for (auto &row : start)
-        cin >> row;
+        start.resize(H);
+        for (auto &row : start)
+            cin >> row;
 
-    int H2;
-    cin >> H2;
-    assert(H == H2);
+        int H2;
+        cin >> H2;
+        assert(H == H2);
 
-    vector<string> target(H);
-    for (auto &row : target)
-        cin >> row;
+        target.resize(H);
+        for (auto &row : target)
+            cin >> row;
+    }
 
     auto result = RollingBalls().restorePattern(start, target);
+    checkpoint.set(result);
 
     // To sort of ensure that ErrorReader thread in tester will get a chance
     // to pick all stderr up.
     cerr.flush();
     std::this_thread::sleep_for(std::chrono::milliseconds(200));
 
-    cout << result.size() << endl;
-    for (auto s : result)
-        cout << s.c_str() << endl;
-
-    cout.flush();
+    checkpoint.flush(STDOUT_FILENO);
+    save_subproblem_corpus();
+    render_snapshots();
     return 0;
 }
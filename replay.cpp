@@ -0,0 +1,95 @@
+// Re-runs subproblems captured with capture_nodes or capture_ms (see
+// Subproblem in solution.cpp) in isolation, each with a fresh failure
+// cache, the node limit it had and the search knobs it was captured with,
+// and compares with the capture. Knobs given on the command line take
+// precedence, with a warning for each record where they differ.
+//
+//   g++ ... replay.cpp -o replay
+//   ./replay [knob=value...] < subproblems.txt
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <cassert>
+
+using namespace std;
+
+#define LOCAL
+#define NO_DRAW_BOARDS
+
+#include "solution.cpp"
+
+
+int main(int argc, char **argv) {
+    map<string, int> command_line_knobs;
+    vector<string> args(argv + 1, argv + argc);
+    for (auto arg : args) {
+        int pos = arg.find('=');
+        assert(pos != string::npos);
+        auto key = arg.substr(0, pos);
+        auto value = stoi(arg.substr(pos + 1));
+        assert(knobs.count(key) > 0);
+        knobs.at(key) = value;
+        command_line_knobs[key] = value;
+    }
+
+    int num_subproblems = 0;
+    int num_solved = 0;
+    int num_changed = 0;  // solved with a different number of stages
+    int64_t replay_nodes = 0;
+    int64_t captured_nodes = 0;
+    double replay_time = 0;
+    double captured_time = 0;
+
+    const auto base_knobs = knobs;  // for records without knobs
+    Subproblem subproblem;
+    while (subproblem.read(cin)) {
+        knobs = base_knobs;
+        for (const auto &kv : subproblem.search_knobs) {
+            auto it = command_line_knobs.find(kv.first);
+            if (it == command_line_knobs.end()) {
+                knobs.at(kv.first) = kv.second;
+            } else if (it->second != kv.second) {
+                cerr << "warning: " << num_subproblems << " was captured with "
+                     << kv.first.c_str() << "=" << kv.second
+                     << ", replaying with " << it->second << endl;
+            }
+        }
+        set_geometry(subproblem.w, subproblem.h);
+        FailureCache failures(knobs.at("failure_window"));
+        SearchBudget budget(subproblem.max_nodes);
+
+        double start = get_time();
+        auto res = windowed_multistep(
+            subproblem.board, subproblem.goals, subproblem.p,
+            subproblem.depth, subproblem.radius, subproblem.fallback,
+            budget, failures);
+        double time = get_time() - start;
+
+        cerr << num_subproblems << ": depth " << subproblem.depth
+             << ", nodes " << subproblem.nodes << " -> " << budget.nodes
+             << ", time " << subproblem.time << " -> " << time
+             << ", stages " << subproblem.stages << " -> " << res.first
+             << endl;
+
+        num_subproblems++;
+        if (res.first)
+            num_solved++;
+        if (res.first != subproblem.stages)
+            num_changed++;
+        replay_nodes += budget.nodes;
+        captured_nodes += subproblem.nodes;
+        replay_time += time;
+        captured_time += subproblem.time;
+    }
+
+    cerr << "# "; debug(num_subproblems);
+    cerr << "# "; debug(num_solved);
+    cerr << "# "; debug(num_changed);
+    cerr << "# "; debug(replay_nodes);
+    cerr << "# "; debug(captured_nodes);
+    cerr << "# "; debug(replay_time);
+    cerr << "# "; debug(captured_time);
+    return 0;
+}
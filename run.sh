@@ -10,14 +10,14 @@ if [ "$RELEASE" = true ]; then
     g++ \
         --std=c++0x -W -Wall -Wno-sign-compare -Wno-unused \
         -O2 -pipe -mmmx -msse -msse2 -msse3 \
-        -ggdb \
+        -ggdb -pthread \
         -DNDEBUG \
         main.cpp -o main
 else
     clang++ \
         --std=c++0x -W -Wall -Wno-sign-compare \
         -O2 -pipe -mmmx -msse -msse2 -msse3 \
-        -ggdb \
+        -ggdb -pthread \
         -D_GLIBCXX_DEBUG -D_GLIBCXX_DEBUG_PEDANTIC \
         -fsanitize=integer,undefined"$MAYBE_ASAN" \
         -fno-sanitize-recover \
@@ -57,7 +57,7 @@ def main():
         #'g++ --std=c++11 -Wall -Wno-sign-compare -O2 main.cc -o main',
         'g++ --std=c++0x -W -Wall -Wno-sign-compare '
         '-DNDEBUG '
-        '-O2 -s -pipe -mmmx -msse -msse2 -msse3 main.cpp -o main',
+        '-O2 -s -pipe -mmmx -msse -msse2 -msse3 -pthread main.cpp -o main',
         shell=True)
     command = './main'
 
@@ -0,0 +1,234 @@
+"""
+Scaling benchmark: runs the solver on generated boards from tester size
+up to about 2000x2000 and fits phase_*_time and phase_*_peak_rss_kb
+(printed by restorePattern) as c * cells^k. The solve phase is also
+split into basin scoring, goal rebuilding and search (phase_solve_score_time
+and so on, summed over solver threads), so that each gets a fit of its own.
+
+    python3 scaling.py [--baseline RUN_ID] [--sizes 20,100,2000] ...
+    python3 scaling.py --corpus sweep.bin ...
+
+With --corpus, the boards are written once to that corpus.py file (if
+it doesn't exist yet) and main reads them through mmap, which saves
+parsing the large ones from stdin on every run.
+
+Each size is recorded as one result in runs/ (see run_db.py), the fits
+go to the run attributes. With --baseline, phases whose exponent grew
+by more than --tolerance since that run are flagged.
+"""
+
+import argparse
+import ast
+import math
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+from timeit import default_timer
+
+import corpus
+import run_db
+
+
+DEFAULT_SIZES = [20, 40, 60, 100, 200, 400, 700, 1000, 1400, 2000]
+
+
+def generate(size, wall_density, ball_density, num_colors, seed):
+    rnd = random.Random(seed)
+    cells = size * size
+    kinds = ['#'] * int(cells * wall_density)
+    num_balls = int(cells * ball_density)
+    kinds += [str(rnd.randrange(num_colors)) for _ in range(num_balls)]
+    kinds += ['.'] * (cells - len(kinds))
+    rnd.shuffle(kinds)
+    target = kinds
+
+    # same walls, balls shuffled over the remaining cells
+    free = [i for i, c in enumerate(target) if c != '#']
+    balls = [target[i] for i in free if target[i] != '.']
+    balls += ['.'] * (len(free) - len(balls))
+    rnd.shuffle(balls)
+    start = list(target)
+    for i, c in zip(free, balls):
+        start[i] = c
+
+    def rows(board):
+        return [''.join(board[i * size:(i + 1) * size]) for i in range(size)]
+    lines = [str(size)] + rows(start) + [str(size)] + rows(target)
+    return '\n'.join(lines) + '\n'
+
+
+def run_solution(command, size, board, timeout):
+    with tempfile.TemporaryFile() as err:
+        start = default_timer()
+        p = subprocess.Popen(
+            'exec ' + command, shell=True,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=err)
+        timed_out = False
+        try:
+            p.communicate(board.encode(), timeout=timeout)
+        except subprocess.TimeoutExpired:
+            # main flushes its checkpoint and exits
+            timed_out = True
+            p.terminate()
+            p.communicate()
+        elapsed = default_timer() - start
+        assert p.returncode == 0, p.returncode
+
+        result = dict(
+            seed='n{}'.format(size), size=size, time=elapsed,
+            timed_out=timed_out)
+        err.seek(0)
+        for line in err:
+            m = re.match(r'# (\w+) = (.*)$', line.decode(errors='replace'))
+            if m is not None:
+                result[m.group(1)] = ast.literal_eval(m.group(2))
+        return result
+
+
+def fit(points):
+    """Least squares for log(y) = log(c) + k * log(x), returns (k, c)."""
+    points = [(math.log(x), math.log(y)) for x, y in points if y > 0]
+    if len(points) < 2:
+        return None
+    n = len(points)
+    mx = sum(x for x, _ in points) / n
+    my = sum(y for _, y in points) / n
+    sxx = sum((x - mx)**2 for x, _ in points)
+    if sxx == 0:
+        return None
+    k = sum((x - mx) * (y - my) for x, y in points) / sxx
+    return k, math.exp(my - k * mx)
+
+
+def fit_phases(results):
+    metrics = sorted({
+        key for result in results for key in result
+        if re.match(r'phase_\w+_(time|peak_rss_kb)$', key)})
+    fits = {}
+    for key in metrics:
+        # timer resolution noise dominates below that
+        points = [
+            (r['size']**2, r[key]) for r in results
+            if key in r and (not key.endswith('_time') or r[key] > 1e-3)]
+        f = fit(points)
+        if f is not None:
+            fits[key] = f
+    return fits
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument(
+        '--sizes', default=','.join(map(str, DEFAULT_SIZES)),
+        help='board sides, comma-separated')
+    parser.add_argument('--wall_density', type=float, default=0.15)
+    parser.add_argument('--ball_density', type=float, default=0.05)
+    parser.add_argument('--colors', type=int, default=4)
+    parser.add_argument('--seed', type=int, default=42)
+    parser.add_argument(
+        '--knobs', default='time_limit_ms=3000 portfolio=1',
+        help='passed to main')
+    parser.add_argument(
+        '--draw', action='store_true',
+        help='keep DRAW_BOARDS (the heatmap alone is quadratic)')
+    parser.add_argument(
+        '--run_timeout', type=float, default=60,
+        help='seconds, larger sizes are skipped after that')
+    parser.add_argument('--baseline', help='run id in runs/ to compare with')
+    parser.add_argument(
+        '--corpus', help='corpus.py file with the boards, created if missing')
+    parser.add_argument('--tolerance', type=float, default=0.2)
+    args = parser.parse_args()
+
+    subprocess.check_call(
+        'g++ --std=c++0x -W -Wall -Wno-sign-compare -Wno-unused '
+        '-DNDEBUG {} '
+        '-O2 -s -pipe -mmmx -msse -msse2 -msse3 -pthread main.cpp -o main'
+        .format('' if args.draw else '-DNO_DRAW_BOARDS'),
+        shell=True)
+    command = './main ' + args.knobs
+
+    sizes = [int(s) for s in args.sizes.split(',')]
+    seeds = [args.seed + size for size in sizes]
+    if args.corpus:
+        if not os.path.exists(args.corpus):
+            corpus.write(args.corpus, [
+                (seed, generate(
+                    size, args.wall_density, args.ball_density,
+                    args.colors, seed))
+                for size, seed in zip(sizes, seeds)])
+        sweep = corpus.Corpus(args.corpus)
+        headers = [sweep.header(i) for i in range(len(sweep))]
+        expected = [
+            dict(w=size, h=size, seed=seed)
+            for size, seed in zip(sizes, seeds)]
+        actual = [dict(w=h['w'], h=h['h'], seed=h['seed']) for h in headers]
+        if actual != expected:
+            sys.exit('{} has other boards than --sizes and --seed ask for'
+                     .format(args.corpus))
+
+    with run_db.RunRecorder() as run:
+        run.attrs['scaling'] = dict(
+            wall_density=args.wall_density, ball_density=args.ball_density,
+            colors=args.colors, seed=args.seed, knobs=args.knobs,
+            corpus=args.corpus)
+        for i, (size, seed) in enumerate(zip(sizes, seeds)):
+            if args.corpus:
+                result = run_solution(
+                    '{} --corpus={} --instance={}'.format(
+                        command, args.corpus, i),
+                    size, '', args.run_timeout)
+            else:
+                board = generate(
+                    size, args.wall_density, args.ball_density,
+                    args.colors, seed)
+                result = run_solution(command, size, board, args.run_timeout)
+            print('{:5} {:8.2f}s {:8} kb  score {}{}'.format(
+                size, result['time'],
+                result.get('phase_output_peak_rss_kb', '?'),
+                result.get('score', '?'),
+                '  TIMED OUT' if result['timed_out'] else ''))
+            sys.stdout.flush()
+            run.add_result(result)
+            run.save()
+            if result['timed_out']:
+                run.attrs['timed_out_at'] = size
+                break
+
+        fits = fit_phases(run.results)
+        run.attrs['fits'] = fits
+        run.save()
+
+    baseline_fits = {}
+    if args.baseline:
+        baseline_fits = run_db.Run(args.baseline).attrs.get('fits', {})
+
+    print()
+    print('{:36} {:>6} {:>10}'.format('metric', 'k', 'c'))
+    num_flagged = 0
+    for key, (k, c) in sorted(fits.items()):
+        line = '{:36} {:6.2f} {:10.3g}'.format(key, k, c)
+        if key in baseline_fits:
+            base_k = baseline_fits[key][0]
+            line += '   was {:.2f}'.format(base_k)
+            if k > base_k + args.tolerance:
+                line += '   WORSE'
+                num_flagged += 1
+        print(line)
+    if args.baseline:
+        base_limit = run_db.Run(args.baseline).attrs.get('timed_out_at')
+        limit = run.attrs.get('timed_out_at')
+        if limit is not None and (base_limit is None or limit < base_limit):
+            print('times out at {}, was {}'.format(limit, base_limit))
+            num_flagged += 1
+    if num_flagged:
+        print('{} regression(s) compared to {}'.format(
+            num_flagged, args.baseline))
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -9,12 +9,28 @@
 #include <iterator>
 #include <algorithm>
 #include <map>
+#include <array>
+#include <unordered_map>
 #include <sstream>
+#include <fstream>
 #include <cstdint>
 #include <iomanip>
 #include <random>
-#include <sys/time.h>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <csignal>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <functional>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "pretty_printing.h"
 
@@ -39,7 +55,7 @@ const double TIME_LIMIT = 9.0;
 #endif
 
 
-int get_time_cnt = 0;
+thread_local int get_time_cnt = 0;
 double get_time() {
     get_time_cnt++;
     timeval tv;
@@ -48,17 +64,402 @@ double get_time() {
 }
 
 
+// Parts of a phase that run interleaved with each other, possibly in
+// several threads. PartScope adds its wall time to the part, summed over
+// threads; a nested scope pauses the enclosing one, so parts don't
+// overlap.
+enum PhasePart {
+    PART_SCORE,  // basin_score
+    PART_GOALS,  // State::rebuild_goals in multistep
+    PART_OPENINGS,  // route_ball, for Backtracker openings and RoutePlanner
+    PART_SEARCH,  // the rest of windowed_multistep
+    NUM_PHASE_PARTS
+};
+const char *phase_part_names[NUM_PHASE_PARTS] = {
+    "score", "goals", "openings", "search"};
+atomic<int64_t> phase_part_us[NUM_PHASE_PARTS];
+
+class PartScope {
+public:
+    explicit PartScope(PhasePart part)
+        : part(part), outer(current), start(get_time()) {
+        if (outer != nullptr)
+            outer->add(start);
+        current = this;
+    }
+    ~PartScope() {
+        double now = get_time();
+        add(now);
+        current = outer;
+        if (outer != nullptr)
+            outer->start = now;
+    }
+    PartScope(const PartScope&) = delete;
+    PartScope& operator=(const PartScope&) = delete;
+
+    // Time of this thread that belongs to no part, such as waiting.
+    class Idle {
+    public:
+        Idle() : scope(current) {
+            if (scope != nullptr)
+                scope->add(get_time());
+        }
+        ~Idle() {
+            if (scope != nullptr)
+                scope->start = get_time();
+        }
+    private:
+        PartScope *scope;
+    };
+
+private:
+    static thread_local PartScope *current;
+    PhasePart part;
+    PartScope *outer;
+    double start;
+
+    void add(double now) {
+        phase_part_us[part].fetch_add(
+            int64_t((now - start) * 1e6), memory_order_relaxed);
+    }
+};
+thread_local PartScope *PartScope::current = nullptr;
+
+
+// Prints wall time and peak RSS at the end of each phase as metrics,
+// phase_<name>_time and phase_<name>_peak_rss_kb (see scaling.py), and
+// time of its parts that ran as phase_<name>_<part>_time. Peak RSS is of
+// the phase alone where /proc/self/clear_refs can reset it (Linux), and
+// of the process so far otherwise.
+class PhaseReport {
+public:
+    PhaseReport() : last(get_time()) {
+        reset_peak_rss();
+    }
+
+    void end(const char *phase) {
+        double now = get_time();
+        int64_t peak_rss_kb = read_peak_rss_kb();
+        reset_peak_rss();
+        cerr << "# phase_" << phase << "_time = " << now - last << endl;
+        cerr << "# phase_" << phase << "_peak_rss_kb = " << peak_rss_kb << endl;
+        for (int i = 0; i < NUM_PHASE_PARTS; i++) {
+            int64_t us = phase_part_us[i].exchange(0);
+            if (us > 0) {
+                cerr << "# phase_" << phase << "_" << phase_part_names[i]
+                     << "_time = " << us * 1e-6 << endl;
+            }
+        }
+        last = now;
+    }
+
+private:
+    double last;
+
+    static int64_t read_peak_rss_kb() {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0)
+                return stoll(line.substr(6));
+        }
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    static void reset_peak_rss() {
+        ofstream("/proc/self/clear_refs") << "5";
+    }
+};
+
+
+// Memory accounting per subsystem. Containers that belong to one use
+// TrackedAllocator with its domain; other memory can be booked for a
+// scope with MemoryCharge. Reported as mem_<domain>_* metrics.
+enum MemoryDomain {
+    MEM_STATE,  // State contents, including copies
+    MEM_UNDO,  // State undo logs
+    MEM_OPENINGS,  // Backtracker openings cache
+    MEM_BASIN,  // basin_score temporaries
+    MEM_BFS,  // BfsWorkspace
+    MEM_FAILURES,  // FailureCache
+    NUM_MEMORY_DOMAINS
+};
+const char *memory_domain_names[NUM_MEMORY_DOMAINS] = {
+    "state", "undo", "openings", "basin", "bfs", "failures"};
+
+struct MemoryCounters {
+    atomic<int64_t> live{0};
+    atomic<int64_t> peak{0};
+    atomic<int64_t> allocs{0};
+
+    void add(int64_t bytes) {
+        allocs.fetch_add(1, memory_order_relaxed);
+        int64_t now = live.fetch_add(bytes, memory_order_relaxed) + bytes;
+        int64_t old_peak = peak.load(memory_order_relaxed);
+        while (now > old_peak &&
+               !peak.compare_exchange_weak(old_peak, now, memory_order_relaxed)) {}
+    }
+    void remove(int64_t bytes) {
+        live.fetch_sub(bytes, memory_order_relaxed);
+    }
+};
+MemoryCounters memory_counters[NUM_MEMORY_DOMAINS];
+
+template<class T, int D>
+class TrackedAllocator {
+public:
+    typedef T value_type;
+    template<class U> struct rebind { typedef TrackedAllocator<U, D> other; };
+
+    TrackedAllocator() {}
+    template<class U> TrackedAllocator(const TrackedAllocator<U, D>&) {}
+
+    T* allocate(size_t n) {
+        memory_counters[D].add(n * sizeof(T));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t n) {
+        memory_counters[D].remove(n * sizeof(T));
+        ::operator delete(p);
+    }
+};
+template<class T, class U, int D>
+bool operator==(const TrackedAllocator<T, D>&, const TrackedAllocator<U, D>&) {
+    return true;
+}
+template<class T, class U, int D>
+bool operator!=(const TrackedAllocator<T, D>&, const TrackedAllocator<U, D>&) {
+    return false;
+}
+
+template<class T, int D>
+using TrackedVector = vector<T, TrackedAllocator<T, D>>;
+
+class MemoryCharge {
+public:
+    MemoryCharge(int domain, int64_t bytes) : domain(domain), bytes(bytes) {
+        memory_counters[domain].add(bytes);
+    }
+    ~MemoryCharge() {
+        memory_counters[domain].remove(bytes);
+    }
+private:
+    int domain;
+    int64_t bytes;
+};
+
+void report_memory() {
+    for (int d = 0; d < NUM_MEMORY_DOMAINS; d++) {
+        const auto &c = memory_counters[d];
+        const char *name = memory_domain_names[d];
+        cerr << "# mem_" << name << "_peak_bytes = " << c.peak.load() << endl;
+        cerr << "# mem_" << name << "_live_bytes = " << c.live.load() << endl;
+        cerr << "# mem_" << name << "_allocs = " << c.allocs.load() << endl;
+    }
+}
+
+
+// Sampling profiler over phase tags. ProfileScope pushes a tag on a per
+// thread stack; every profile_us of CPU time a SIGPROF handler counts the
+// top tag as self and each distinct tag on the stack as total.
+const int MAX_PROFILE_TAGS = 64;  // tag 0 is for overflow
+const int MAX_PROFILE_STACK = 32;
+
+mutex profile_tags_mutex;
+vector<string> profile_tag_names = {"other"};
+atomic<int64_t> profile_self[MAX_PROFILE_TAGS];
+atomic<int64_t> profile_total[MAX_PROFILE_TAGS];
+atomic<int64_t> profile_samples{0};
+
+// Zero-initialized, so that the handler doesn't run TLS constructors.
+struct ProfileStack {
+    int tags[MAX_PROFILE_STACK];
+    volatile sig_atomic_t size;
+};
+thread_local ProfileStack profile_stack;
+
+// Registers the tag on first use; call sites keep ids in statics.
+int profile_tag(const string &name) {
+    lock_guard<mutex> lock(profile_tags_mutex);
+    for (int i = 0; i < profile_tag_names.size(); i++)
+        if (profile_tag_names[i] == name)
+            return i;
+    if (profile_tag_names.size() == MAX_PROFILE_TAGS)
+        return 0;
+    profile_tag_names.push_back(name);
+    return profile_tag_names.size() - 1;
+}
+
+// Tags <prefix>0 .. <prefix>(size - 1), for depths and such; larger
+// numbers share the last one.
+class ProfileTagFamily {
+public:
+    ProfileTagFamily(const string &prefix, int size) {
+        for (int i = 0; i < size; i++)
+            ids.push_back(profile_tag(prefix + to_string(i)));
+    }
+    int operator[](int i) const {
+        return ids[min<int>(i, ids.size() - 1)];
+    }
+private:
+    vector<int> ids;
+};
+
+class ProfileScope {
+public:
+    ProfileScope(int tag) {
+        ProfileStack &stack = profile_stack;
+        if (stack.size < MAX_PROFILE_STACK)
+            stack.tags[stack.size] = tag;
+        atomic_signal_fence(memory_order_release);
+        stack.size = stack.size + 1;
+    }
+    ~ProfileScope() {
+        profile_stack.size = profile_stack.size - 1;
+    }
+};
+
+void profile_signal_handler(int) {
+    const ProfileStack &stack = profile_stack;
+    int size = stack.size;
+    size = min(size, MAX_PROFILE_STACK);
+    profile_samples++;
+    if (size == 0)
+        return;
+    uint64_t seen = 0;
+    for (int i = 0; i < size; i++) {
+        int tag = stack.tags[i];
+        if (!(seen >> tag & 1)) {
+            seen |= 1ULL << tag;
+            profile_total[tag]++;
+        }
+    }
+    profile_self[stack.tags[size - 1]]++;
+}
+
+void start_profiler(int interval_us) {
+    struct sigaction action = {};
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, nullptr);
+    itimerval timer = {};
+    timer.it_interval.tv_usec = interval_us;
+    timer.it_value.tv_usec = interval_us;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void stop_profiler() {
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+// As profile_<tag>_self_pct and profile_<tag>_total_pct, for tags that
+// were sampled.
+void report_profile() {
+    int64_t samples = profile_samples.load();
+    cerr << "# profile_samples = " << samples << endl;
+    if (samples == 0)
+        return;
+    lock_guard<mutex> lock(profile_tags_mutex);
+    for (int i = 0; i < profile_tag_names.size(); i++) {
+        if (profile_total[i].load() == 0)
+            continue;
+        const char *name = profile_tag_names[i].c_str();
+        cerr << "# profile_" << name << "_self_pct = "
+             << 100.0 * profile_self[i].load() / samples << endl;
+        cerr << "# profile_" << name << "_total_pct = "
+             << 100.0 * profile_total[i].load() / samples << endl;
+    }
+}
+
+
 map<string, int> custom_knobs;  // from argv
 map<string, int> knobs = {
-    {"return_empty", 0}
+    {"return_empty", 0},
+    {"blocking_penalty", 20},
+    {"failure_window", 6},
+    {"solve_window", 0},  // 0 to solve on the full board
+    {"window_fallback", 1},
+    {"time_limit_ms", int(TIME_LIMIT * 1000)},
+    {"max_depth", 6},
+    {"budget_slack", 10},  // node budget in fair shares
+    {"portfolio", -1},  // number of strategies to run, -1 for one per core
+    {"beam_width", 0},  // 0 for greedy placement
+    {"beam_branching", 3},
+    {"max_stages", 2},  // of multistep, including the final one
+    {"stage_candidates", 2},  // subgoals tried per stage
+    {"optimize_lookahead", 8},  // moves of one ball, 0 to keep moves as is
+    {"move_ordering", 1},  // killer and history heuristics in Backtracker
+    {"ordering_min_depth", 5},  // remaining depth to order moves at
+    // State::lower_bound instead of max(n1, n2); off because it also prunes
+    // branches try_solve_with_openings would finish for free
+    {"matching_bound", 0},
+    {"basin_samples", 10},  // random obstacle layouts per basin_score
+    // rescoring happens about rescore_divisor * rescore_rate times per pass,
+    // depending on the wall bucket; bucket 2 doesn't rescore
+    {"rescore_divisor", 5},
+    {"rescore_divisor_walls", 10},
+    // bucket = (wall fraction - bucket_offset_pct / 100) * bucket_scale
+    {"bucket_offset_pct", 10},
+    {"bucket_scale", 15},
+    {"checkpoint_ms", 100},  // how often solvers publish their progress
+    {"watchdog_ms", 0},  // main.cpp flushes the checkpoint and exits, 0 off
+    // solve_target calls over either goes to the subproblem corpus, 0 off
+    {"capture_nodes", 0},
+    {"capture_ms", 0},
+    // SIGPROF period of the phase profiler, 0 off; main.cpp turns it on
+    {"profile_us", 0},
+    // rescore in a background thread: 1 on, 0 off, -1 if there is a spare
+    // core for each greedy solver
+    {"score_pipeline", -1},
+    // Match balls to targets per color (BallAssignment), postpone targets
+    // by assignment_weight per roll of their ball and, with
+    // assignment_reserve, keep openings off balls of other targets. Colors
+    // with more than assignment_exact targets are matched greedily.
+    {"assignment", 0},
+    {"assignment_weight", 10},
+    {"assignment_reserve", 1},
+    {"assignment_exact", 150},
+    // greedy targets searched at once, in slices of interleave_slice nodes
+    {"interleave", 1},
+    {"interleave_slice", 20000},
+    // before each greedy search, route balls to as many of the next
+    // route_batch targets as RoutePlanner can, 0 off
+    {"route_batch", 0},
 };
 
 
-int W = -1;
-int H = -1;
+// Per thread, since solving on a window switches them temporarily.
+thread_local int W = -1;
+thread_local int H = -1;
+
+
+thread_local array<int, 4> DIRS;
+
+
+void set_geometry(int w, int h) {
+    ::W = w;
+    ::H = h;
+    DIRS = {{1, -1, w, -w}};
+}
 
 
-array<int, 4> DIRS;
+// Temporarily switches global board geometry, eg. to solve on a window
+// extracted from the full board.
+class GeometryScope {
+public:
+    GeometryScope(int w, int h) : old_w(::W), old_h(::H) {
+        set_geometry(w, h);
+    }
+    ~GeometryScope() {
+        set_geometry(old_w, old_h);
+    }
+private:
+    int old_w;
+    int old_h;
+};
 
 
 typedef char Cell;
@@ -66,11 +467,11 @@ const Cell WALL = '#';
 const Cell EMPTY = '.';
 const Cell FORBIDDEN = 'x';
 bool is_valid_cell(Cell c) {
-    return c == WALL || c == EMPTY || (c >= '0' && c <= '9');
+    return c == WALL || c == EMPTY || c == FORBIDDEN || (c >= '0' && c <= '9');
 }
 bool is_ball(Cell c) {
     assert(is_valid_cell(c));
-    if (c == WALL || c == EMPTY)
+    if (c == WALL || c == EMPTY || c == FORBIDDEN)
         return false;
     return true;
 }
@@ -94,7 +495,30 @@ pair<int, int> unpack(PackedCoord p) {
 }
 
 
+// Compile-time direction, indexing DIRS: right, left, down, up.
+// Kernels templated on it keep the stride in a register and get
+// unrolled across the four directions.
+template<int D>
+struct Dir {
+    static int offset() {
+        static_assert(D >= 0 && D < 4, "bad direction");
+        return D == 0 ? 1 : D == 1 ? -1 : D == 2 ? ::W : -::W;
+    }
+};
+
+
 typedef pair<int, int> Move;
+int move_dir_index(Move move) {
+    int d = move.second - move.first;
+    assert(d != 0);
+    if (d <= -::W)
+        return 3;
+    if (d < 0)
+        return 1;
+    if (d < ::W)
+        return 0;
+    return 2;
+}
 int move_dir(Move move) {
     int d = move.second - move.first;
     if (d <= -::W)
@@ -122,49 +546,130 @@ const int BLUE = 34;
 const int MAGENTA = 35;
 const int CYAN = 36;
 const int WHITE = 37;
-void ansi_style(int color, bool inverse=false) {
+void ansi_style(ostream &out, int color, bool inverse=false) {
     if (inverse)
-        cerr << "\033[7";
+        out << "\033[7";
     else
-        cerr << "\033[0";
+        out << "\033[0";
     if (color != DEFAULT_COLOR) {
         assert(color >= 30);
         assert(color <= 37);
-        cerr << ";" << color;
+        out << ";" << color;
     }
-    cerr << "m";
+    out << "m";
 }
-void ansi_default() {
-    cerr << "\033[0m";
+void ansi_default(ostream &out) {
+    out << "\033[0m";
 }
 
 
-void draw_board(function<void(PackedCoord)> draw_cell_fn) {
+typedef function<void(ostream &out, PackedCoord p)> DrawCellFn;
+
+// Board pictures are only recorded while solving (draw_cell_fn has to
+// capture copies of whatever it looks at) and drawn by render_snapshots()
+// once the answer is out (see main.cpp), so that DRAW_BOARDS doesn't
+// change timing.
+struct Snapshot {
+    int w;
+    int h;
+    DrawCellFn draw_cell_fn;
+};
+mutex snapshots_mutex;
+vector<Snapshot> snapshots;
+
+void draw_board(DrawCellFn draw_cell_fn) {
 #ifdef DRAW_BOARDS
-    for (int i = 1; i < ::H - 1; i++) {
-        for (int j = 1; j < ::W - 1; j++) {
-            draw_cell_fn(pack(j, i));
-            ansi_default();
+    lock_guard<mutex> lock(snapshots_mutex);
+    snapshots.push_back({::W, ::H, draw_cell_fn});
+#else
+    (void)draw_cell_fn;
+#endif
+}
+
+void render_snapshots() {
+    lock_guard<mutex> lock(snapshots_mutex);
+    for (const auto &snapshot : snapshots) {
+        GeometryScope geometry(snapshot.w, snapshot.h);
+        ostringstream out;
+        for (int i = 1; i < ::H - 1; i++) {
+            for (int j = 1; j < ::W - 1; j++) {
+                snapshot.draw_cell_fn(out, pack(j, i));
+                ansi_default(out);
+            }
+            out << "|\n";
         }
-        cerr << "|" << endl;
+        cerr << out.str().c_str() << flush;
     }
-#endif
+    snapshots.clear();
+}
+
+
+// Last cell of the empty run starting next to 'from' in direction D
+// ('from' itself if there is none).
+template<int D>
+inline PackedCoord roll_end(const Board &board, PackedCoord from) {
+    const int d = Dir<D>::offset();
+    PackedCoord pos = from;
+    while (board[pos + d] == EMPTY)
+        pos += d;
+    return pos;
+}
+#ifdef __SSE2__
+// Horizontal runs are contiguous, so compare 16 cells at a time.
+template<>
+inline PackedCoord roll_end<0>(const Board &board, PackedCoord from) {
+    const Cell *b = board.data();
+    const __m128i empty = _mm_set1_epi8(EMPTY);
+    PackedCoord pos = from + 1;
+    while (pos + 16 <= (int)board.size()) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(b + pos));
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, empty)) & 0xffff;
+        if (mask)
+            return pos + __builtin_ctz(mask) - 1;
+        pos += 16;
+    }
+    while (b[pos] == EMPTY)
+        pos++;
+    return pos - 1;
+}
+template<>
+inline PackedCoord roll_end<1>(const Board &board, PackedCoord from) {
+    const Cell *b = board.data();
+    const __m128i empty = _mm_set1_epi8(EMPTY);
+    PackedCoord pos = from - 1;
+    while (pos >= 15) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(b + pos - 15));
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, empty)) & 0xffff;
+        if (mask)
+            return pos - 15 + (31 - __builtin_clz(mask)) + 1;
+        pos -= 16;
+    }
+    while (b[pos] == EMPTY)
+        pos--;
+    return pos + 1;
 }
+#endif
 
 
+template<int D, typename OUT_ITER>
+inline OUT_ITER gen_forward_rolls_dir(
+    PackedCoord from, const Board &board, OUT_ITER result) {
+
+    PackedCoord pos = roll_end<D>(board, from);
+    if (pos != from && board[pos + Dir<D>::offset()] != FORBIDDEN) {
+        *result = pos; ++result;
+    }
+    return result;
+}
 template<typename OUT_ITER>
 OUT_ITER gen_forward_rolls(
     PackedCoord from, const Board &board, OUT_ITER result) {
 
     assert(board[from] != WALL);
-    for (int d : DIRS) {
-        PackedCoord pos = from;
-        while (board[pos + d] == EMPTY)
-            pos += d;
-        if (pos != from && board[pos + d] != FORBIDDEN) {
-            *result = pos; ++result;
-        }
-    }
+    result = gen_forward_rolls_dir<0>(from, board, result);
+    result = gen_forward_rolls_dir<1>(from, board, result);
+    result = gen_forward_rolls_dir<2>(from, board, result);
+    result = gen_forward_rolls_dir<3>(from, board, result);
     return result;
 }
 vector<PackedCoord> gen_forward_rolls_vector(
@@ -176,20 +681,29 @@ vector<PackedCoord> gen_forward_rolls_vector(
 }
 
 
+template<int D, typename OUT_ITER>
+inline OUT_ITER gen_backward_rolls_dir(
+    PackedCoord to, const Board &board, OUT_ITER result) {
+
+    const int d = Dir<D>::offset();
+    if (board[to - d] != EMPTY && board[to - d] != FORBIDDEN) {
+        PackedCoord end = roll_end<D>(board, to);
+        for (PackedCoord pos = to; pos != end;) {
+            pos += d;
+            *result = pos; ++result;
+        }
+    }
+    return result;
+}
 template<typename OUT_ITER>
 OUT_ITER gen_backward_rolls(
     PackedCoord to, const Board &board, OUT_ITER result) {
 
     // assert(board[to] == EMPTY);
-    for (int d : DIRS) {
-        if (board[to - d] != EMPTY && board[to - d] != FORBIDDEN) {
-            PackedCoord pos = to + d;
-            while (board[pos] == EMPTY) {
-                *result = pos; ++result;
-                pos += d;
-            }
-        }
-    }
+    result = gen_backward_rolls_dir<0>(to, board, result);
+    result = gen_backward_rolls_dir<1>(to, board, result);
+    result = gen_backward_rolls_dir<2>(to, board, result);
+    result = gen_backward_rolls_dir<3>(to, board, result);
     return result;
 }
 vector<PackedCoord> gen_backward_rolls_vector(
@@ -201,6 +715,68 @@ vector<PackedCoord> gen_backward_rolls_vector(
 }
 
 
+// Reusable scratch space for flood fills over the board, one per thread.
+// Clearing is O(1): a cell counts as visited only if its stamp matches the
+// current epoch. Every cell enters the frontier at most once per epoch, so
+// the frontier fits in a flat buffer of board size.
+class BfsWorkspace {
+public:
+    class Inserter;
+
+    void reset(int size) {
+        if (stamps.size() < size) {
+            stamps.resize(size, 0);
+            parents.resize(size);
+            frontier.resize(size);
+        }
+        if (++epoch == 0) {
+            fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+        head = tail = 0;
+    }
+
+    bool visited(PackedCoord p) const { return stamps[p] == epoch; }
+    Move& parent(PackedCoord p) { return parents[p]; }
+
+    // marks as visited
+    void push(PackedCoord p) {
+        assert(!visited(p));
+        stamps[p] = epoch;
+        frontier[tail++] = p;
+    }
+    bool frontier_empty() const { return head == tail; }
+    PackedCoord pop() { return frontier[head++]; }
+    int num_pushed() const { return tail; }
+    int num_popped() const { return head; }
+
+    // Output iterator that pushes cells not visited yet.
+    class Inserter {
+    public:
+        Inserter(BfsWorkspace &ws) : ws(&ws) {}
+        Inserter& operator*() { return *this; }
+        Inserter& operator++() { return *this; }
+        Inserter& operator=(PackedCoord p) {
+            if (!ws->visited(p))
+                ws->push(p);
+            return *this;
+        }
+    private:
+        BfsWorkspace *ws;
+    };
+    Inserter inserter() { return Inserter(*this); }
+
+private:
+    uint32_t epoch = 0;
+    TrackedVector<uint32_t, MEM_BFS> stamps;
+    TrackedVector<Move, MEM_BFS> parents;
+    TrackedVector<PackedCoord, MEM_BFS> frontier;
+    int head = 0;
+    int tail = 0;
+};
+thread_local BfsWorkspace bfs_workspace;
+
+
 void apply_move(Board &board, Move move) {
     auto tos = gen_forward_rolls_vector(move.first, board);
     assert(find(tos.begin(), tos.end(), move.second) != tos.end());
@@ -208,6 +784,186 @@ void apply_move(Board &board, Move move) {
     board[move.first] = EMPTY;
 }
 
+// Applies moves while they are legal; returns whether all were.
+bool try_apply_moves(Board &board, const vector<Move> &moves) {
+    for (auto move : moves) {
+        if (!is_ball(board[move.first]))
+            return false;
+        auto tos = gen_forward_rolls_vector(move.first, board);
+        if (find(tos.begin(), tos.end(), move.second) == tos.end())
+            return false;
+        apply_move(board, move);
+    }
+    return true;
+}
+
+// Shortest roll sequence bringing one ball to the empty destination while
+// all other balls stay put, found by BFS backwards from destination. Only
+// balls with accept(cell) may come; balls without prefer(cell) are used
+// only if no other can. Moves are backwards (from destination towards the
+// ball), as in Backtracker solutions; empty if no ball can come.
+template<class Accept, class Prefer>
+vector<Move> route_ball(
+    const Board &board, PackedCoord destination,
+    Accept accept, Prefer prefer) {
+    PartScope part_scope(PART_OPENINGS);
+    assert(board[destination] == EMPTY);
+
+    vector<Move> fallback;
+    BfsWorkspace &ws = bfs_workspace;
+    ws.reset(board.size());
+    ws.push(destination);
+    ws.parent(destination) = Move(-1, -1);
+    while (!ws.frontier_empty()) {
+        PackedCoord p = ws.pop();
+
+        for (int d : DIRS) {
+            if (board[p + d] == EMPTY || board[p + d] == FORBIDDEN)
+                continue;
+            PackedCoord pp = p - d;
+            while (board[pp] == EMPTY) {
+                if (!ws.visited(pp)) {
+                    ws.parent(pp) = {p, pp};
+                    ws.push(pp);
+                }
+                pp -= d;
+            }
+
+            // TODO: take into account that this cell shouldn't be in goals
+            if (!is_ball(board[pp]) || !accept(pp))
+                continue;
+
+            bool valid = true;
+            vector<Move> route;
+            route.emplace_back(p, pp);
+            PackedCoord t = p;
+            while (t != destination) {
+                // make sure we don't bounce off ourselves
+                const Move &last_move = ws.parent(t);
+                int dd = move_dir(last_move);
+                if (last_move.first - dd == pp) {
+                    valid = false;
+                    break;
+                }
+
+                route.push_back(last_move);
+                t = last_move.first;
+            }
+            if (!valid)
+                continue;
+            reverse(route.begin(), route.end());
+            if (!prefer(pp)) {
+                // in case no other ball can come
+                if (fallback.empty())
+                    fallback = route;
+                continue;
+            }
+            return route;
+        }
+    }
+    return fallback;
+}
+
+
+// Balls of a board by color, and by row and column in sorted order, so
+// that lookups take time proportional to the answer instead of scanning
+// cells. Kept valid by apply_move(board, index, move).
+class BallIndex {
+public:
+    BallIndex(const Board &board)
+        : w(::W), slots(board.size(), -1), colors(board.size(), EMPTY),
+          by_color(10), rows(::H), columns(::W) {
+        for (PackedCoord p = 0; p < board.size(); p++) {
+            if (!is_ball(board[p]))
+                continue;
+            auto &list = by_color[board[p] - '0'];
+            slots[p] = list.size();
+            list.push_back(p);
+            colors[p] = board[p];
+            // in increasing order already
+            rows[p / w].push_back(p);
+            columns[p % w].push_back(p);
+        }
+    }
+
+    int num_balls() const {
+        int result = 0;
+        for (const auto &list : by_color)
+            result += list.size();
+        return result;
+    }
+
+    // In no particular order.
+    const vector<PackedCoord>& balls(Cell color) const {
+        assert(is_ball(color));
+        return by_color[color - '0'];
+    }
+
+    // All balls in increasing order of position.
+    template<class F>
+    void for_each_ball(F f) const {
+        for (const auto &row : rows)
+            for (PackedCoord p : row)
+                f(p);
+    }
+
+    // First ball after p in direction d (of given color unless any_color),
+    // or -1. Walls are not taken into account.
+    PackedCoord nearest_in_lane(
+            PackedCoord p, int d, Cell color = EMPTY) const {
+        const auto &lane = d == 1 || d == -1 ? rows[p / w] : columns[p % w];
+        if (d > 0) {
+            for (auto it = upper_bound(lane.begin(), lane.end(), p);
+                 it != lane.end(); ++it)
+                if (color == EMPTY || colors[*it] == color)
+                    return *it;
+        } else {
+            for (auto it = lower_bound(lane.begin(), lane.end(), p);
+                 it != lane.begin(); ) {
+                --it;
+                if (color == EMPTY || colors[*it] == color)
+                    return *it;
+            }
+        }
+        return -1;
+    }
+
+    void move_ball(PackedCoord from, PackedCoord to) {
+        assert(slots[from] != -1 && slots[to] == -1);
+        auto &list = by_color[colors[from] - '0'];
+        list[slots[from]] = to;
+        swap(slots[from], slots[to]);
+        swap(colors[from], colors[to]);
+
+        erase_sorted(rows[from / w], from);
+        insert_sorted(rows[to / w], to);
+        erase_sorted(columns[from % w], from);
+        insert_sorted(columns[to % w], to);
+    }
+
+private:
+    int w;
+    vector<int> slots;  // position in by_color, -1 if no ball
+    vector<Cell> colors;  // EMPTY if no ball
+    vector<vector<PackedCoord>> by_color;
+    vector<vector<PackedCoord>> rows;
+    vector<vector<PackedCoord>> columns;
+
+    static void erase_sorted(vector<PackedCoord> &lane, PackedCoord p) {
+        auto it = lower_bound(lane.begin(), lane.end(), p);
+        assert(it != lane.end() && *it == p);
+        lane.erase(it);
+    }
+    static void insert_sorted(vector<PackedCoord> &lane, PackedCoord p) {
+        lane.insert(lower_bound(lane.begin(), lane.end(), p), p);
+    }
+};
+
+void apply_move(Board &board, BallIndex &index, Move move) {
+    apply_move(board, move);
+    index.move_ball(move.first, move.second);
+}
+
 
 enum CellSet {
     CS_UNKNOWN = 0,
@@ -217,6 +973,8 @@ enum CellSet {
     // TODO: check that there are no off-by-ones
     CS_LAST_BALL = CS_ANY_BALL + 10,
     CS_WALL = 13,
+    // can't hold a ball and can't be rolled through or stopped against
+    CS_FORBIDDEN = 14,
     CS_CONTRADICTION = 123
 };
 bool is_valid_cs(CellSet s) {
@@ -224,7 +982,8 @@ bool is_valid_cs(CellSet s) {
         s == CS_UNKNOWN ||
         s == CS_EMPTY ||
         (s >= CS_ANY_BALL && s <= CS_LAST_BALL) ||
-        s == CS_WALL;
+        s == CS_WALL ||
+        s == CS_FORBIDDEN;
 }
 bool cs_is_ball(CellSet s) {
     assert(is_valid_cs(s));
@@ -248,6 +1007,8 @@ char cs_to_char(CellSet s) {
         return '?';
     case CS_WALL:
         return 'W';
+    case CS_FORBIDDEN:
+        return 'x';
     case CS_CONTRADICTION:
         return '!';
     default:
@@ -296,7 +1057,8 @@ const Conflict CONFLICT_REPLACE = 3;
 class State {
 public:
     State(const Board &initial_board, map<PackedCoord, CellSet> goal)
-        : initial_board(initial_board), cur(initial_board.size(), CS_UNKNOWN) {
+        : initial_board(initial_board), cur(initial_board.size(), CS_UNKNOWN),
+          lane_clears(::W + ::H), lane_fills(::W + ::H) {
 
         undo_log.reserve(256);
         conflict_undo_log.reserve(256);
@@ -305,6 +1067,8 @@ public:
         for (Cell cell : initial_board) {
             if (cell == WALL)
                 cur[p] = CS_WALL;
+            else if (cell == FORBIDDEN)
+                cur[p] = CS_FORBIDDEN;
             p++;
         }
 
@@ -317,38 +1081,51 @@ public:
 
     void show() {
         // assert(check_conflicts());
-        draw_board([this](PackedCoord p) {
+#ifdef DRAW_BOARDS
+        vector<Conflict> conflict_types(cur.size(), NO_CONFLICT);
+        for (PackedCoord p : conflicts)
+            conflict_types[p] = conflict_type(p);
+        auto cur = this->cur;
+        Board initial_board = this->initial_board;
+        draw_board([cur, initial_board, conflict_types](
+                ostream &out, PackedCoord p) {
             auto cs = cur[p];
             auto c = initial_board[p];
 
             if (c == WALL) {
                 assert(cs == CS_WALL);
-                ansi_style(DEFAULT_COLOR, true);
-                cerr << "  ";
+                ansi_style(out, DEFAULT_COLOR, true);
+                out << "  ";
+                return;
+            }
+            if (c == FORBIDDEN) {
+                assert(cs == CS_FORBIDDEN);
+                out << "xx";
                 return;
             }
 
             if (cs != CS_UNKNOWN) {
-                switch (conflict_type(p)) {
+                switch (conflict_types[p]) {
                 case NO_CONFLICT:
-                    ansi_style(GREEN);
+                    ansi_style(out, GREEN);
                     break;
                 case CONFLICT_FILL:
-                    ansi_style(GREEN, true);
+                    ansi_style(out, GREEN, true);
                     break;
                 case CONFLICT_CLEAR:
-                    ansi_style(RED, true);
+                    ansi_style(out, RED, true);
                     break;
                 case CONFLICT_REPLACE:
-                    ansi_style(YELLOW, true);
+                    ansi_style(out, YELLOW, true);
                     break;
                 default:
                     assert(false);
                 }
             }
-            cerr << cs_to_char(cs);
-            cerr << (c == EMPTY ? ' ' : c);
+            out << cs_to_char(cs);
+            out << (c == EMPTY ? ' ' : c);
         });
+#endif
         // cerr << "moves: ";
         // for (auto move : moves)
         //     cerr << unpack_move(move) << " ";
@@ -391,40 +1168,11 @@ public:
             for (PackedCoord from : froms_to_explore) {
                 explored_froms.push_back(from);
 
-                for (int dir : DIRS) {
-                    CellSet fulcrum = combine_with_obstacle(cur[from - dir]);
-                    if (fulcrum == CS_CONTRADICTION)
-                        continue;
-
-                    RestorePoint rp(*this);
-                    edit_cur(from - dir, fulcrum);
-
-                    // TODO: move out of loop body
-                    // TODO: combine with any ball just in case
-                    CellSet rolling_ball = cur[from];
-                    edit_cur(from, CS_EMPTY);
-
-                    PackedCoord p = from + dir;
-                    while (true) {
-                        auto e = combine_cs_with_empty(cur[p]);
-                        if (e == CS_CONTRADICTION) {
-                            if (cur[p] != CS_WALL && stage == 0) {
-                                stage1_froms.insert(p);
-                            }
-                            break;
-                        }
-
-                        {
-                            RestorePoint rp2(*this);
-                            edit_cur(p, rolling_ball);
-                            // assert(check_conflicts());
-                            callback({from, p});
-                        }
-
-                        edit_cur(p, e);
-                        p += dir;
-                    }
-                }
+                bool collect = stage == 0;
+                expand_from<0>(from, collect, stage1_froms, callback);
+                expand_from<1>(from, collect, stage1_froms, callback);
+                expand_from<2>(from, collect, stage1_froms, callback);
+                expand_from<3>(from, collect, stage1_froms, callback);
             }
         }
 
@@ -437,42 +1185,29 @@ public:
             if (ct != CONFLICT_FILL)
                 continue;
 
-            for (int dir : DIRS) {
-                RestorePoint rp(*this);
-                PackedCoord p = to - dir;
-                while (true) {
-                    auto rolling_ball = combine_cs_with_any_ball(cur[p]);
-                    if (rolling_ball != CS_CONTRADICTION) {
-                        auto fulcrum = combine_with_obstacle(cur[p - dir]);
-                        if (fulcrum != CS_CONTRADICTION &&
-                            !binary_search(
-                                explored_froms.begin(), explored_froms.end(), p)) {
-
-                            RestorePoint rp2(*this);
-                            edit_cur(p - dir, fulcrum);
-                            edit_cur(p, CS_EMPTY);
-                            edit_cur(to, rolling_ball);
-                            // assert(check_conflicts());
-
-                            callback({p, to});
-                        }
-                    }
-
-                    auto e = combine_cs_with_empty(cur[p]);
-                    if (e == CS_CONTRADICTION)
-                        break;
-                    edit_cur(p, e);
-                    p -= dir;
-                }
-            }
+            expand_fill<0>(to, explored_froms, callback);
+            expand_fill<1>(to, explored_froms, callback);
+            expand_fill<2>(to, explored_froms, callback);
+            expand_fill<3>(to, explored_froms, callback);
         }
 
     }
 
     void apply_move(Move move) {
+        switch (move_dir_index(move)) {
+        case 0: apply_move_dir<0>(move); break;
+        case 1: apply_move_dir<1>(move); break;
+        case 2: apply_move_dir<2>(move); break;
+        case 3: apply_move_dir<3>(move); break;
+        default: assert(false);
+        }
+    }
+
+    template<int D>
+    void apply_move_dir(Move move) {
         PackedCoord from = move.first;
         PackedCoord to = move.second;
-        int dir = move_dir(move);
+        const int dir = Dir<D>::offset();
 
         CellSet fulcrum = combine_with_obstacle(cur[from - dir]);
         assert(fulcrum != CS_CONTRADICTION);
@@ -496,9 +1231,24 @@ public:
         edit_cur(to, rolling_ball);
     }
 
-    const vector<PackedCoord>& get_conflicts() const { return conflicts; }
+    const TrackedVector<PackedCoord, MEM_STATE>& get_conflicts() const { return conflicts; }
+    // CLEAR and REPLACE conflicts
+    int num_clears() const { return total_clears; }
+    // FILL and REPLACE conflicts
+    int num_fills() const { return total_fills; }
+
+    // Admissible bound on the number of moves to resolve all conflicts.
+    // A move clears at most one cell (where it starts) and fills at most
+    // one (where it stops), so it takes num_clears + num_fills moves minus
+    // those doing both, which pair cells in the same row or column. Their
+    // number is bounded by the sum over rows and columns of
+    // min(clears, fills). Openings are not search moves and aren't counted.
+    int lower_bound() const {
+        int both = min(lane_pairs, min(total_clears, total_fills));
+        return total_clears + total_fills - both;
+    }
     const Board& get_initial_board() const { return initial_board; }
-    const vector<CellSet>& get_cur() const { return cur; }
+    const TrackedVector<CellSet, MEM_STATE>& get_cur() const { return cur; }
 
     map<PackedCoord, CellSet> rebuild_goals() const {
         map<PackedCoord, CellSet> result;
@@ -517,7 +1267,7 @@ public:
         ~RestorePoint() {
             assert(state.undo_log.size() >= undo_log_size);
             while (state.undo_log.size() > undo_log_size) {
-                state.cur[state.undo_log.back().first] = state.undo_log.back().second;
+                state.set_cur(state.undo_log.back().first, state.undo_log.back().second);
                 state.undo_log.pop_back();
             }
 
@@ -543,6 +1293,7 @@ public:
 
     Conflict conflict_type(PackedCoord p) const {
         assert(initial_board[p] != WALL);
+        assert(initial_board[p] != FORBIDDEN);
 
         if (initial_board[p] == EMPTY) {
             if (combine_cs_with_empty(cur[p]) == CS_CONTRADICTION)
@@ -564,24 +1315,138 @@ public:
 
 private:
     const Board &initial_board;
-    vector<CellSet> cur;
-    vector<PackedCoord> conflicts;
+    TrackedVector<CellSet, MEM_STATE> cur;
+    TrackedVector<PackedCoord, MEM_STATE> conflicts;
 
-    vector<pair<PackedCoord, CellSet>> undo_log;
+    TrackedVector<pair<PackedCoord, CellSet>, MEM_UNDO> undo_log;
     // positive to add, negative to remove
-    vector<PackedCoord> conflict_undo_log;
+    TrackedVector<PackedCoord, MEM_UNDO> conflict_undo_log;
+
+    // conflict counts for lower_bound(), rows first, then columns
+    int total_clears = 0;
+    int total_fills = 0;
+    TrackedVector<int, MEM_STATE> lane_clears;
+    TrackedVector<int, MEM_STATE> lane_fills;
+    int lane_pairs = 0;  // sum of min(clears, fills) over lanes
+
+    void count_lane(int lane, int clears, int fills) {
+        lane_pairs -= min(lane_clears[lane], lane_fills[lane]);
+        lane_clears[lane] += clears;
+        lane_fills[lane] += fills;
+        lane_pairs += min(lane_clears[lane], lane_fills[lane]);
+    }
 
-    void edit_cur(PackedCoord p, CellSet new_cs) {
-        assert(is_valid_cs(new_cs));
-        if (cur[p] != new_cs) {
-            assert(initial_board[p] != WALL);
-            assert(new_cs != CS_WALL);
+    void count_conflict(PackedCoord p, Conflict c, int sign) {
+        int clears = sign * (c == CONFLICT_CLEAR || c == CONFLICT_REPLACE);
+        int fills = sign * (c == CONFLICT_FILL || c == CONFLICT_REPLACE);
+        if (clears == 0 && fills == 0)
+            return;
+        total_clears += clears;
+        total_fills += fills;
+        count_lane(p / ::W, clears, fills);
+        count_lane(::H + p % ::W, clears, fills);
+    }
 
-            undo_log.emplace_back(p, cur[p]);
+    // Changes cur[p] keeping the conflict counts, but not the conflict
+    // list, up to date.
+    void set_cur(PackedCoord p, CellSet new_cs) {
+        count_conflict(p, conflict_type(p), -1);
+        cur[p] = new_cs;
+        count_conflict(p, conflict_type(p), +1);
+    }
+
+    // Moves the ball at 'from' (on the goal side) in direction D to every
+    // cell it could have come from. Removable obstacles that stop the roll
+    // are collected if requested.
+    template<int D>
+    void expand_from(
+            PackedCoord from, bool collect_obstacles,
+            set<PackedCoord> &obstacles,
+            const function<void(Move move)> &callback) {
+        const int dir = Dir<D>::offset();
+
+        CellSet fulcrum = combine_with_obstacle(cur[from - dir]);
+        if (fulcrum == CS_CONTRADICTION)
+            return;
+
+        RestorePoint rp(*this);
+        edit_cur(from - dir, fulcrum);
+
+        // TODO: move out of loop body
+        // TODO: combine with any ball just in case
+        CellSet rolling_ball = cur[from];
+        edit_cur(from, CS_EMPTY);
+
+        PackedCoord p = from + dir;
+        while (true) {
+            auto e = combine_cs_with_empty(cur[p]);
+            if (e == CS_CONTRADICTION) {
+                if (cs_is_ball(cur[p]) && collect_obstacles) {
+                    obstacles.insert(p);
+                }
+                break;
+            }
+
+            {
+                RestorePoint rp2(*this);
+                edit_cur(p, rolling_ball);
+                // assert(check_conflicts());
+                callback({from, p});
+            }
+
+            edit_cur(p, e);
+            p += dir;
+        }
+    }
+
+    // Brings some ball into FILL conflict 'to' rolling in direction D.
+    template<int D>
+    void expand_fill(
+            PackedCoord to, const vector<PackedCoord> &explored_froms,
+            const function<void(Move move)> &callback) {
+        const int dir = Dir<D>::offset();
+
+        RestorePoint rp(*this);
+        PackedCoord p = to - dir;
+        while (true) {
+            auto rolling_ball = combine_cs_with_any_ball(cur[p]);
+            if (rolling_ball != CS_CONTRADICTION) {
+                auto fulcrum = combine_with_obstacle(cur[p - dir]);
+                if (fulcrum != CS_CONTRADICTION &&
+                    !binary_search(
+                        explored_froms.begin(), explored_froms.end(), p)) {
+
+                    RestorePoint rp2(*this);
+                    edit_cur(p - dir, fulcrum);
+                    edit_cur(p, CS_EMPTY);
+                    edit_cur(to, rolling_ball);
+                    // assert(check_conflicts());
+
+                    callback({p, to});
+                }
+            }
+
+            auto e = combine_cs_with_empty(cur[p]);
+            if (e == CS_CONTRADICTION)
+                break;
+            edit_cur(p, e);
+            p -= dir;
+        }
+    }
+
+    void edit_cur(PackedCoord p, CellSet new_cs) {
+        assert(is_valid_cs(new_cs));
+        if (cur[p] != new_cs) {
+            assert(initial_board[p] != WALL);
+            assert(new_cs != CS_WALL);
+
+            undo_log.emplace_back(p, cur[p]);
 
             Conflict old_conflict = conflict_type(p);
+            count_conflict(p, old_conflict, -1);
             cur[p] = new_cs;
             Conflict new_conflict = conflict_type(p);
+            count_conflict(p, new_conflict, +1);
 
             if (old_conflict == NO_CONFLICT && new_conflict != NO_CONFLICT) {
                 conflicts.push_back(p);
@@ -598,7 +1463,7 @@ private:
 
     bool check_conflicts() const {
         for (PackedCoord p = 0; p < initial_board.size(); p++) {
-            if (initial_board[p] == WALL)
+            if (initial_board[p] == WALL || initial_board[p] == FORBIDDEN)
                 continue;
             auto it = find(conflicts.begin(), conflicts.end(), p);
             if (conflict_type(p) == NO_CONFLICT)
@@ -606,6 +1471,15 @@ private:
             else
                 assert(it != conflicts.end());
         }
+        int clears = 0;
+        int fills = 0;
+        for (PackedCoord p : conflicts) {
+            Conflict c = conflict_type(p);
+            clears += c == CONFLICT_CLEAR || c == CONFLICT_REPLACE;
+            fills += c == CONFLICT_FILL || c == CONFLICT_REPLACE;
+        }
+        assert(clears == total_clears);
+        assert(fills == total_fills);
         return true;
     }
 };
@@ -660,7 +1534,8 @@ bool commute(Move move1, Move move2) {
     return true;
 }
 
-bool commute(const vector<Move> &moves1, const vector<Move> &moves2) {
+template<class Moves1, class Moves2>
+bool commute(const Moves1 &moves1, const Moves2 &moves2) {
     for (const Move &move1 : moves1)
         for (const Move &move2 : moves2)
             if (!commute(move1, move2))
@@ -670,42 +1545,37 @@ bool commute(const vector<Move> &moves1, const vector<Move> &moves2) {
 
 
 int basin_area(const Board &board, PackedCoord destination) {
-    vector<PackedCoord> worklist;
-    vector<bool> visited(board.size(), false);
-    int result = 0;
-
-    worklist.push_back(destination);
-    visited[destination] = true;
-    while (!worklist.empty()) {
-        PackedCoord p = worklist.back();
-        worklist.pop_back();
-
-        for (auto p2 : gen_backward_rolls_vector(p, board)) {
-            if (!visited[p2]) {
-                result++;
-                visited[p2] = true;
-                worklist.push_back(p2);
-            }
-        }
-    }
+    BfsWorkspace &ws = bfs_workspace;
+    ws.reset(board.size());
 
-    return result;
+    ws.push(destination);
+    while (!ws.frontier_empty())
+        gen_backward_rolls(ws.pop(), board, ws.inserter());
+
+    // destination itself is not counted
+    return ws.num_pushed() - 1;
 }
 
 
+// index is of board.
 double basin_score(
-        const Board &board, PackedCoord destination,
-        map<PackedCoord, CellSet> achieved) {
-    vector<PackedCoord> balls;
-    for (PackedCoord p = 0; p < board.size(); p++)
-        if (is_ball(board[p]) && achieved.count(p) == 0)
+        const Board &board, const BallIndex &index, PackedCoord destination,
+        const map<PackedCoord, CellSet> &achieved) {
+    static const int profile = profile_tag("basin_score");
+    ProfileScope profile_scope(profile);
+    PartScope part_scope(PART_SCORE);
+    TrackedVector<PackedCoord, MEM_BASIN> balls;
+    index.for_each_ball([&](PackedCoord p) {
+        if (achieved.count(p) == 0)
             balls.push_back(p);
+    });
 
     Board adjusted = board;
+    MemoryCharge charge(MEM_BASIN, adjusted.capacity() * sizeof(Cell));
     double result = 0;
     default_random_engine gen(42);
 
-    const int N = 10;
+    const int N = knobs.at("basin_samples");
     for (int i = 0; i < N; i++) {
         for (auto p : balls) {
             if (bernoulli_distribution(0.5)(gen)) {
@@ -723,19 +1593,359 @@ double basin_score(
 }
 
 
+// Static blocking relation between target cells.
+// Ball placed at q blocks target p if q is the first target cell on one of
+// the roll lanes leading into p (lane exists when there is a wall or another
+// target ball behind p to stop against). Weight is the fraction of p's lane
+// cells cut off by q.
+class GoalGraph {
+public:
+    GoalGraph(const Board &target) {
+        for (PackedCoord p = 0; p < target.size(); p++) {
+            if (!is_ball(target[p]))
+                continue;
+
+            vector<pair<PackedCoord, double>> blockers;
+            int num_lanes = 0;
+            for (int d : DIRS) {
+                if (target[p + d] == EMPTY || target[p - d] == WALL)
+                    continue;
+                num_lanes++;
+
+                int lane_length = 0;
+                int dist_to_blocker = -1;
+                for (PackedCoord q = p - d; target[q] != WALL; q -= d) {
+                    lane_length++;
+                    if (dist_to_blocker == -1 && is_ball(target[q])) {
+                        dist_to_blocker = lane_length;
+                        blockers.emplace_back(q, 0.0);
+                    }
+                }
+                if (dist_to_blocker != -1) {
+                    blockers.back().second =
+                        1.0 * (lane_length - dist_to_blocker + 1) / lane_length;
+                }
+            }
+
+            for (auto kv : blockers) {
+                blocks[kv.first].emplace_back(p, kv.second / num_lanes);
+                blocked_by[p].emplace_back(kv.first, kv.second / num_lanes);
+            }
+        }
+    }
+
+    // Takes targets with priorities (higher goes first) and returns them
+    // in the order they should be attempted. Targets that cut lanes of
+    // other pending targets are postponed; penalty is in priority units
+    // per fully blocked target.
+    vector<PackedCoord> order(
+            const vector<pair<double, PackedCoord>> &targets,
+            double penalty) const {
+        map<PackedCoord, int> index;
+        for (int i = 0; i < targets.size(); i++)
+            index[targets[i].second] = i;
+
+        vector<double> blocked_weight(targets.size(), 0.0);
+        for (int i = 0; i < targets.size(); i++) {
+            auto it = blocks.find(targets[i].second);
+            if (it == blocks.end())
+                continue;
+            for (auto kv : it->second)
+                if (index.count(kv.first))
+                    blocked_weight[i] += kv.second;
+        }
+
+        vector<PackedCoord> result;
+        vector<bool> done(targets.size(), false);
+        for (int k = 0; k < targets.size(); k++) {
+            int best = -1;
+            double best_priority = 0;
+            for (int i = 0; i < targets.size(); i++) {
+                if (done[i])
+                    continue;
+                double priority = targets[i].first - penalty * blocked_weight[i];
+                if (best == -1 || priority >= best_priority) {
+                    best = i;
+                    best_priority = priority;
+                }
+            }
+            done[best] = true;
+            PackedCoord p = targets[best].second;
+            result.push_back(p);
+
+            // p is no longer pending, so its blockers lose the weight
+            auto it = blocked_by.find(p);
+            if (it == blocked_by.end())
+                continue;
+            for (auto kv : it->second) {
+                auto j = index.find(kv.first);
+                if (j != index.end() && !done[j->second])
+                    blocked_weight[j->second] -= kv.second;
+            }
+        }
+        return result;
+    }
+
+private:
+    // blocker -> [(blocked target, weight)]
+    map<PackedCoord, vector<pair<PackedCoord, double>>> blocks;
+    // blocked target -> [(blocker, weight)]
+    map<PackedCoord, vector<pair<PackedCoord, double>>> blocked_by;
+};
+
+
+// Min-cost assignment of rows to distinct columns (no more rows than
+// columns), returns the column of each row. O(rows^2 columns).
+vector<int> hungarian(const vector<vector<int>> &cost) {
+    int n = cost.size();
+    int m = n ? cost[0].size() : 0;
+    assert(n <= m);
+    const int INF = 1 << 29;
+    // 1-based, row 0 and column 0 are fictive
+    vector<int> u(n + 1), v(m + 1), row_of(m + 1), way(m + 1);
+    for (int i = 1; i <= n; i++) {
+        row_of[0] = i;
+        int j0 = 0;
+        vector<int> min_v(m + 1, INF);
+        vector<char> used(m + 1, false);
+        do {
+            used[j0] = true;
+            int i0 = row_of[j0];
+            int delta = INF;
+            int j1 = 0;
+            for (int j = 1; j <= m; j++) {
+                if (used[j])
+                    continue;
+                int c = cost[i0 - 1][j - 1] - u[i0] - v[j];
+                if (c < min_v[j]) {
+                    min_v[j] = c;
+                    way[j] = j0;
+                }
+                if (min_v[j] < delta) {
+                    delta = min_v[j];
+                    j1 = j;
+                }
+            }
+            for (int j = 0; j <= m; j++) {
+                if (used[j]) {
+                    u[row_of[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    min_v[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (row_of[j0] != 0);
+        do {
+            int j1 = way[j0];
+            row_of[j0] = row_of[j1];
+            j0 = j1;
+        } while (j0);
+    }
+    vector<int> result(n, -1);
+    for (int j = 1; j <= m; j++)
+        if (row_of[j] != 0)
+            result[row_of[j] - 1] = j - 1;
+    return result;
+}
+
+
+// Assignment of balls to pending targets by min-cost matching per color.
+// Cost is the number of rolls between the cells on the static board if
+// balls could stop anywhere (rook moves between walls), capped at
+// MAX_COST; with wall segments of rows and columns it takes O(1) per pair.
+// Colors with more than max_exact targets are matched greedily by cost.
+class BallAssignment {
+public:
+    static const int MAX_COST = 3;
+    int64_t num_rematched = 0;
+
+    BallAssignment(const Board &target, int max_exact)
+        : target(target), max_exact(max_exact),
+          row_segment(target.size(), -1), column_segment(target.size(), -1),
+          assigned_ball(target.size(), -1),
+          targets_by_color(10), last_balls(10), last_targets(10) {
+        int segment = 0;
+        for (PackedCoord p = 0; p < target.size(); p++) {
+            if (target[p] == WALL)
+                continue;
+            if (is_ball(target[p]))
+                targets_by_color[target[p] - '0'].push_back(p);
+            row_segment[p] =
+                target[p - 1] == WALL ? segment++ : row_segment[p - 1];
+            column_segment[p] =
+                target[p - ::W] == WALL ? segment++ : column_segment[p - ::W];
+        }
+    }
+
+    // Rematches colors whose unplaced balls or pending targets changed.
+    void update(const BallIndex &board_balls,
+                const map<PackedCoord, CellSet> &achieved) {
+        for (int c = 0; c < 10; c++) {
+            vector<PackedCoord> balls;
+            for (PackedCoord p : board_balls.balls('0' + c))
+                if (achieved.count(p) == 0)
+                    balls.push_back(p);
+            sort(balls.begin(), balls.end());
+            vector<PackedCoord> targets;
+            for (PackedCoord p : targets_by_color[c])
+                if (achieved.count(p) == 0)
+                    targets.push_back(p);
+            if (balls == last_balls[c] && targets == last_targets[c])
+                continue;
+            for (PackedCoord p : last_targets[c])
+                assigned_ball[p] = -1;
+            match(balls, targets);
+            last_balls[c] = balls;
+            last_targets[c] = targets;
+            num_rematched++;
+        }
+    }
+
+    // -1 if none.
+    PackedCoord ball_for(PackedCoord p) const { return assigned_ball[p]; }
+
+    int cost(PackedCoord p) const {
+        PackedCoord q = assigned_ball[p];
+        return q == -1 ? MAX_COST : distance(q, p);
+    }
+
+    // Board-sized mask of balls assigned to pending targets other than p.
+    vector<char> reserved_except(PackedCoord p) const {
+        vector<char> result(target.size(), false);
+        for (const auto &targets : last_targets)
+            for (PackedCoord q : targets)
+                if (q != p && assigned_ball[q] != -1)
+                    result[assigned_ball[q]] = true;
+        return result;
+    }
+
+private:
+    const Board &target;
+    int max_exact;
+    vector<int> row_segment;
+    vector<int> column_segment;
+    vector<PackedCoord> assigned_ball;  // by target cell
+    vector<vector<PackedCoord>> targets_by_color;
+    // as of the last match, per color
+    vector<vector<PackedCoord>> last_balls;
+    vector<vector<PackedCoord>> last_targets;
+
+    int distance(PackedCoord a, PackedCoord b) const {
+        if (a == b)
+            return 0;
+        if (row_segment[a] == row_segment[b] ||
+            column_segment[a] == column_segment[b])
+            return 1;
+        // along the row of a, then the column of b, or the other way
+        PackedCoord corner = pack(unpack_x(b), unpack_y(a));
+        if (row_segment[corner] == row_segment[a] &&
+            column_segment[corner] == column_segment[b])
+            return 2;
+        corner = pack(unpack_x(a), unpack_y(b));
+        if (column_segment[corner] == column_segment[a] &&
+            row_segment[corner] == row_segment[b])
+            return 2;
+        return MAX_COST;
+    }
+
+    void match(const vector<PackedCoord> &balls,
+               const vector<PackedCoord> &targets) {
+        if (balls.empty() || targets.empty())
+            return;
+        // rows are the smaller side
+        bool by_target = targets.size() <= balls.size();
+        const auto &rows = by_target ? targets : balls;
+        const auto &columns = by_target ? balls : targets;
+        vector<vector<int>> cost(rows.size(), vector<int>(columns.size()));
+        for (int i = 0; i < rows.size(); i++)
+            for (int j = 0; j < columns.size(); j++)
+                cost[i][j] = distance(rows[i], columns[j]);
+
+        vector<int> column_of(rows.size(), -1);
+        if (rows.size() <= max_exact) {
+            column_of = hungarian(cost);
+        } else {
+            vector<char> used(columns.size(), false);
+            for (int level = 0; level <= MAX_COST; level++)
+                for (int i = 0; i < rows.size(); i++)
+                    for (int j = 0; j < columns.size() && column_of[i] == -1; j++)
+                        if (!used[j] && cost[i][j] == level) {
+                            column_of[i] = j;
+                            used[j] = true;
+                        }
+        }
+        for (int i = 0; i < rows.size(); i++) {
+            if (column_of[i] == -1)
+                continue;
+            if (by_target)
+                assigned_ball[rows[i]] = columns[column_of[i]];
+            else
+                assigned_ball[columns[column_of[i]]] = rows[i];
+        }
+    }
+};
+
+
+// Balls that openings should leave to other targets: mask in the geometry
+// of the board being searched, see BallAssignment. Set by SearchTask.
+thread_local const vector<char> *reserved_balls = nullptr;
+
+
+// Node limit shared by all Backtrackers working on one target, plus
+// statistics for the scheduler.
+struct SearchBudget {
+    int64_t max_nodes;
+    int64_t nodes = 0;
+    // sum of logs of node count ratios between consecutive fully searched
+    // depths, and their number
+    double log_branching = 0;
+    int num_branching_samples = 0;
+
+    // called when nodes reach pause_at, see SearchTask
+    int64_t pause_at = -1;
+    function<void()> on_pause;
+
+    SearchBudget(int64_t max_nodes) : max_nodes(max_nodes) {}
+    bool exhausted() const { return nodes >= max_nodes; }
+    void count_node() {
+        if (++nodes == pause_at)
+            on_pause();
+    }
+};
+
+
 class Backtracker {
 public:
     bool solved;
     vector<Move> solution;
 
-    Backtracker(State &state, int min_depth, int max_depth) : state(state) {
+    Backtracker(State &state, int min_depth, int max_depth, SearchBudget &budget)
+        : state(state), budget(budget) {
+        static const int profile = profile_tag("backtracker");
+        static const ProfileTagFamily profile_depths("depth_", 10);
+        ProfileScope profile_scope(profile);
         solved = false;
+        ordering = knobs.at("move_ordering") != 0;
+        ordering_min_depth = knobs.at("ordering_min_depth");
+        matching_bound = knobs.at("matching_bound") != 0;
+        killers.assign(max_depth + 1, {{Move(-1, -1), Move(-1, -1)}});
+        if (ordering)
+            history.assign(4 * state.get_cur().size(), 0);
+        int64_t prev_cnt = 0;
         for (int depth = min_depth; depth <= max_depth; depth++) {
             // debug(depth);
+            ProfileScope profile_depth_scope(profile_depths[depth]);
+            int64_t start_cnt = cnt;
             rec(depth);
             // debug(cnt);
-            if (solved)
+            if (solved || budget.exhausted())
                 break;
+            if (prev_cnt > 0) {
+                budget.log_branching += log(1.0 * (cnt - start_cnt) / prev_cnt);
+                budget.num_branching_samples++;
+            }
+            prev_cnt = cnt - start_cnt;
         }
         // debug(solved);
 
@@ -753,71 +1963,75 @@ public:
 
 private:
     State &state;
+    SearchBudget &budget;
     vector<Move> moves;
     int64_t cnt = 0;
 
-    typedef vector<Move> Opening;
-    map<pair<PackedCoord, CellSet>, vector<Opening>> openings_cache;
-
+    // Move ordering. At each node the move whose subtree came closest to
+    // solved (lowest conflict bound) is good; killers remember the last two
+    // good moves for each remaining depth, and history accumulates depth^2
+    // for good moves across iterations of deepening. History is keyed by origin and
+    // direction only, which is a flat table and lumps together moves that
+    // differ by how far the ball rolls.
+    bool matching_bound;
+    bool ordering;
+    int ordering_min_depth;
+    vector<array<Move, 2>> killers;
+    vector<int> history;
+    // candidates and their scores, per ply
+    vector<vector<pair<int, Move>>> candidates;
+
+    int history_key(Move move) const {
+        return move.first * 4 + move_dir_index(move);
+    }
 
-    vector<Opening> compute_openings(PackedCoord destination, CellSet ball) {
-        assert(openings_cache.count({destination, ball}) == 0);
-        const Board &initial_board = state.get_initial_board();
-        assert(initial_board[destination] == EMPTY);
+    int move_score(Move move, int depth, const vector<PackedCoord> &clears) {
+        int score = history[history_key(move)];
+        if (killers[depth][0] == move || killers[depth][1] == move)
+            score += 1 << 20;
+        if (find(clears.begin(), clears.end(), move.first) != clears.end())
+            score += 1 << 24;
+        return score;
+    }
 
-        vector<Opening> result;
-        deque<PackedCoord> worklist;
-        vector<Move> last_move(state.get_initial_board().size(), Move(0, 0));
-        last_move[destination] = Move(-1, -1);
-        worklist.push_back(destination);
-        while (!worklist.empty()) {
-            PackedCoord p = worklist.front();
-            worklist.pop_front();
+    void record_good_move(Move move, int depth) {
+        history[history_key(move)] += depth * depth;
+        if (killers[depth][0] != move) {
+            killers[depth][1] = killers[depth][0];
+            killers[depth][0] = move;
+        }
+    }
 
-            assert(last_move[p] != Move(0, 0));
+    typedef TrackedVector<Move, MEM_OPENINGS> Opening;
+    typedef TrackedVector<Opening, MEM_OPENINGS> Openings;
+    typedef pair<PackedCoord, CellSet> OpeningKey;
+    map<OpeningKey, Openings, less<OpeningKey>,
+        TrackedAllocator<pair<const OpeningKey, Openings>, MEM_OPENINGS>>
+        openings_cache;
 
-            for (int d : DIRS) {
-                if (initial_board[p + d] == EMPTY)
-                    continue;
-                PackedCoord pp = p - d;
-                while (initial_board[pp] == EMPTY) {
-                    if (last_move[pp] == Move(0, 0)) {
-                        last_move[pp] = {p, pp};
-                        worklist.push_back(pp);
-                    }
-                    pp -= d;
-                }
 
-                // debug(pp);
-                // TODO: take into account that this cell shouldn't be in goals
-                if (is_ball(initial_board[pp]) &&
-                    state.get_cur()[pp] == CS_UNKNOWN && (
-                        ball == CS_ANY_BALL ||
-                        ball == cell_to_cs(initial_board[pp]))) {
-
-                    bool valid = true;
-                    Opening op;
-                    op.emplace_back(p, pp);
-                    PackedCoord t = p;
-                    while (t != destination) {
-                        // make sure we don't bounce off ourselves
-                        int dd = move_dir(last_move[t]);
-                        if (last_move[t].first - dd == pp) {
-                            valid = false;
-                            break;
-                        }
+    Openings compute_openings(PackedCoord destination, CellSet ball) {
+        assert(openings_cache.count({destination, ball}) == 0);
+        const Board &initial_board = state.get_initial_board();
+        assert(initial_board[destination] == EMPTY);
 
-                        op.push_back(last_move[t]);
-                        t = last_move[t].first;
-                    }
-                    if (valid) {
-                        reverse(op.begin(), op.end());
-                        result.push_back(op);
-                        return result;
-                    }
-                }
-            }
-        }
+        const vector<char> *reserved = reserved_balls;
+        if (reserved != nullptr && reserved->size() != initial_board.size())
+            reserved = nullptr;  // on a window
+
+        Openings result;
+        auto route = route_ball(
+            initial_board, destination,
+            [this, &initial_board, ball](PackedCoord pp) {
+                return state.get_cur()[pp] == CS_UNKNOWN && (
+                    ball == CS_ANY_BALL ||
+                    ball == cell_to_cs(initial_board[pp]));
+            },
+            [reserved](PackedCoord pp) {
+                return reserved == nullptr || !(*reserved)[pp];
+            });
+        if (!route.empty())
+            result.emplace_back(route.begin(), route.end());
 
         /*
         for (int d : DIRS) {
@@ -838,7 +2052,7 @@ private:
         return result;
     }
 
-    const vector<Opening>& get_openings(PackedCoord destination, CellSet ball) {
+    const Openings& get_openings(PackedCoord destination, CellSet ball) {
         assert(ball == CS_ANY_BALL ||
             ball >= CS_FIRST_BALL && ball <= CS_LAST_BALL);
 
@@ -878,48 +2092,37 @@ private:
         return true;
     }
 
-    void rec(int depth) {
-        if (solved)
-            return;
+    // Returns the lowest conflict bound seen in the subtree.
+    int rec(int depth) {
+        if (solved || budget.exhausted())
+            return 0;
 
         cnt++;
+        budget.count_node();
 
         if (state.get_conflicts().empty()) {
             solved = true;
             solution = moves;
-            return;
+            return 0;
         }
 
-        int n1 = 0;
-        int n2 = 0;
-        for (auto p : state.get_conflicts()) {
-            switch (state.conflict_type(p)) {
-            case NO_CONFLICT:
-                break;
-            case CONFLICT_CLEAR:
-                n1++;
-                break;
-            case CONFLICT_FILL:
-                n2++;
-                break;
-            case CONFLICT_REPLACE:
-                n1++;
-                n2++;
-                break;
-            default:
-                assert(false);
-            }
-        }
+        int n1 = state.num_clears();
+        int n2 = state.num_fills();
         if (n1 == state.get_conflicts().size() && n2 == 0) {
             if (try_solve_with_openings())
-                return;
+                return 0;
         }
-        if (max(n1, n2) > depth)
-            return;
+        int bound = matching_bound ? state.lower_bound() : max(n1, n2);
+        if (bound > depth)
+            return bound;
         // TODO: same line heuristic
 
+        // Buffered moves are applied twice (in enumerate_moves and then for
+        // real), which only pays off far enough from the leaves.
+        if (ordering && depth >= ordering_min_depth)
+            return min(bound, rec_ordered(depth));
 
-        state.enumerate_moves([this, depth](Move move){
+        state.enumerate_moves([this, depth, &bound](Move move){
             if (!moves.empty()) {
                 if (moves.back() > move && commute(moves.back(), move))
                     return;
@@ -927,209 +2130,2065 @@ private:
 
             moves.push_back(move);
 
-            rec(depth - 1);
+            bound = min(bound, rec(depth - 1));
 
             assert(moves.back() == move);
             moves.pop_back();
         });
+        return bound;
     }
-};
 
-
-pair<int, vector<Move>> multistep(State state, int depth) {
-    Backtracker bt(state, 1, depth);
-    if (bt.solved) {
-        return {1, bt.solution};
+    // Same as the callback loop in rec, but the moves are collected first
+    // and tried best first.
+    int rec_ordered(int depth) {
+        vector<PackedCoord> clears;
+        for (auto p : state.get_conflicts())
+            if (state.conflict_type(p) == CONFLICT_CLEAR)
+                clears.push_back(p);
+
+        int ply = moves.size();
+        if (candidates.size() <= ply)
+            candidates.resize(ply + 1);
+        auto &cands = candidates[ply];
+        cands.clear();
+        state.enumerate_moves([&](Move move){
+            if (!moves.empty()) {
+                if (moves.back() > move && commute(moves.back(), move))
+                    return;
+            }
+            cands.emplace_back(-move_score(move, depth, clears), move);
+        });
+        stable_sort(cands.begin(), cands.end(),
+            [](const pair<int, Move> &a, const pair<int, Move> &b) {
+                return a.first < b.first;
+            });
+
+        int best_bound = depth + 1;
+        Move best_move(-1, -1);
+        // deeper plies reuse their own buffers, but may reallocate ours
+        for (int i = 0; i < candidates[ply].size(); i++) {
+            Move move = candidates[ply][i].second;
+            State::RestorePoint rp(state);
+            state.apply_move(move);
+            moves.push_back(move);
+            int bound = rec(depth - 1);
+            assert(moves.back() == move);
+            moves.pop_back();
+            if (solved || budget.exhausted())
+                return 0;
+            if (bound < best_bound) {
+                best_bound = bound;
+                best_move = move;
+            }
+        }
+        if (best_move.first != -1)
+            record_good_move(best_move, depth);
+        return best_bound;
     }
-    for (int d : DIRS) {
-        Board board = state.get_initial_board();
-        PackedCoord p = state.get_conflicts().front();
-
-        if (state.get_cur()[p + d] == CS_UNKNOWN && board[p + d] == EMPTY) {
-            auto intermediate_goals = state.rebuild_goals();
-            intermediate_goals.erase(p);
-            intermediate_goals[p + d] = CS_ANY_BALL;
+};
 
-            State s1(board, intermediate_goals);
-            Backtracker bt1(s1, 1, depth);
 
-            if (!bt1.solved)
+// Number of rolls needed to bring the nearest ball to cell 'to' if
+// nothing else moves, or max_dist + 1 if it takes more.
+int roll_distance_from_ball(const Board &board, PackedCoord to, int max_dist) {
+    BfsWorkspace &ws = bfs_workspace;
+    ws.reset(board.size());
+    ws.push(to);
+    int dist = 1;
+    int layer_end = ws.num_pushed();
+    while (!ws.frontier_empty() && dist <= max_dist) {
+        PackedCoord p = ws.pop();
+        for (int d : DIRS) {
+            // ball comes from p + k * d and stops against p - d
+            if (board[p - d] == EMPTY || board[p - d] == FORBIDDEN)
                 continue;
-
-            auto moves1 = bt1.solution;
-            reverse(moves1.begin(), moves1.end());
-            for (auto move : moves1) {
-                move = reversed_move(move);
-                apply_move(board, move);
+            PackedCoord q = p + d;
+            while (board[q] == EMPTY) {
+                if (!ws.visited(q))
+                    ws.push(q);
+                q += d;
             }
-
-            State s2(board, state.rebuild_goals());
-            Backtracker bt2(s2, 1, depth);
-
-            if (!bt2.solved)
-                continue;
-
-            vector<Move> result = bt2.solution;
-            copy(moves1.rbegin(), moves1.rend(), back_inserter(result));
-            return {2, result};
+            if (is_ball(board[q]))
+                return dist;
+        }
+        if (ws.num_popped() == layer_end) {
+            dist++;
+            layer_end = ws.num_pushed();
         }
     }
-    return {0, vector<Move>()};
+    return max_dist + 1;
 }
 
 
-void show_start_and_target(const Board &start, const Board &target) {
-    map<PackedCoord, CellSet> goal;
-    for (PackedCoord p = 0; p < start.size(); p++) {
-        if (is_ball(target[p]))
-            goal[p] = cell_to_cs(target[p]);
+// Intermediate subgoals for bringing a ball to p, nearest (in rolls from
+// some ball) first: blockers next to p that a ball could stop against,
+// and waypoints on roll lanes leading into p.
+vector<PackedCoord> subgoal_candidates(
+        const Board &board, const map<PackedCoord, CellSet> &goals,
+        PackedCoord p, const vector<PackedCoord> &exclude) {
+    vector<PackedCoord> cells;
+    for (int d : DIRS) {
+        if (board[p + d] == EMPTY)
+            cells.push_back(p + d);
+        else if (board[p + d] != FORBIDDEN)
+            for (PackedCoord q = p - 2 * d; board[q + d] == EMPTY; q -= d)
+                if (board[q] == EMPTY)
+                    cells.push_back(q);
     }
-    State state(start, goal);
-    state.show();
+
+    vector<pair<int, PackedCoord>> result;
+    for (PackedCoord q : cells) {
+        if (goals.count(q) ||
+            find(exclude.begin(), exclude.end(), q) != exclude.end())
+            continue;
+        bool seen = false;
+        for (auto r : result)
+            seen |= r.second == q;
+        if (!seen)
+            result.emplace_back(roll_distance_from_ball(board, q, 4), q);
+    }
+    stable_sort(result.begin(), result.end(),
+        [](pair<int, PackedCoord> a, pair<int, PackedCoord> b) {
+            return a.first < b.first;
+        });
+
+    vector<PackedCoord> ordered;
+    for (auto r : result)
+        ordered.push_back(r.second);
+    return ordered;
 }
 
 
-class RollingBalls {
+// Remembers Backtracker subproblems that were searched exhaustively and
+// failed. Key is a hash of the board and goals in a square window around
+// the focus cell (the one the subproblem is about), excluding the goal at
+// focus itself; value is the weakest focus goal that failed.
+// This is a heuristic, not a proof: the board outside the window isn't
+// part of the key, so a failure is also reused where a ball that moved
+// far away would have made the subproblem solvable. (Goals outside the
+// window only accumulate over the run, so they alone can only make a
+// later retry harder.)
+class FailureCache {
 public:
-    vector<string> restorePattern(vector<string> raw_start, vector<string> raw_target) {
-#ifndef LOCAL
-        assert(false && "asserts should be disabled");
-#endif
-        double start_time = get_time();
-        for (int i = 0; i < 1000; i++)
-            get_time();
-        debug(get_time() - start_time);
+    int64_t hits = 0;
 
-        debug(custom_knobs);
-        for (const auto &kv : custom_knobs) {
-            knobs.at(kv.first) = kv.second;
-        }
-        debug(knobs);
+    FailureCache(int radius) : radius(radius) {}
 
-        vector<string> result;
+    bool known_to_fail(const State &state, PackedCoord focus, int depth) {
+        auto it = failures.find(key(state, focus, depth));
+        if (it == failures.end())
+            return false;
+        CellSet goal = state.get_cur()[focus];
+        if (it->second == CS_ANY_BALL || it->second == goal) {
+            hits++;
+            return true;
+        }
+        return false;
+    }
 
-        if (knobs.at("return_empty"))
-            return result;
+    void add_failure(const State &state, PackedCoord focus, int depth) {
+        CellSet goal = state.get_cur()[focus];
+        auto &weakest = failures[key(state, focus, depth)];
+        if (weakest == CS_UNKNOWN || goal == CS_ANY_BALL)
+            weakest = goal;
+    }
 
-        ::H = raw_start.size();
-        ::W = raw_start.front().size();
-        assert(raw_target.size() == ::H);
-        assert(raw_target.front().size() == ::W);
+    int size() const { return failures.size(); }
 
-        cerr << "# "; debug(W);
-        cerr << "# "; debug(H);
+private:
+    int radius;
+    unordered_map<
+        uint64_t, CellSet, hash<uint64_t>, equal_to<uint64_t>,
+        TrackedAllocator<pair<const uint64_t, CellSet>, MEM_FAILURES>> failures;
+
+    static uint64_t mix(uint64_t h, uint64_t x) {
+        // splitmix64 finalizer
+        h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return h;
+    }
 
-        ::H += 2;
-        ::W += 2;
-        DIRS = {{1, -1, ::W, -::W}};
+    uint64_t key(const State &state, PackedCoord focus, int depth) const {
+        const Board &board = state.get_initial_board();
+        const auto &cur = state.get_cur();
+        uint64_t h = mix(focus, depth);
+        int x0 = unpack_x(focus);
+        int y0 = unpack_y(focus);
+        for (int y = max(0, y0 - radius); y <= min(::H - 1, y0 + radius); y++) {
+            for (int x = max(0, x0 - radius); x <= min(::W - 1, x0 + radius); x++) {
+                PackedCoord p = pack(x, y);
+                // the goal at focus is compared by known_to_fail
+                h = mix(h, board[p] * 256 + (p != focus ? cur[p] : 0));
+            }
+        }
+        return h;
+    }
+};
 
-        set<Cell> ball_colors;
-        int num_balls = 0;
-        int num_walls = 0;
-        Board start(::W * ::H, WALL);
-        Board target(::W * ::H, WALL);
-        for (int i = 1; i < ::H - 1; i++) {
-            for (int j = 1; j < ::W - 1; j++) {
-                start[pack(j, i)] = raw_start[i - 1][j - 1];
-                char c = target[pack(j, i)] = raw_target[i - 1][j - 1];
 
-                if (is_ball(c)) {
-                    num_balls++;
-                    ball_colors.insert(c);
-                } else if (c == WALL) {
-                    num_walls++;
-                }
+pair<int, vector<Move>> multistep(
+        State state, int depth, SearchBudget &budget, FailureCache &failures) {
+    static const int profile = profile_tag("multistep");
+    static const ProfileTagFamily profile_stages("stage_", 5);
+    ProfileScope profile_scope(profile);
+    // Backtracker that skips subproblems known to fail.
+    auto solve = [&failures, &budget, depth](State &s, vector<Move> &solution) {
+        if (!s.get_conflicts().empty()) {
+            PackedCoord focus = s.get_conflicts().front();
+            if (failures.known_to_fail(s, focus, depth))
+                return false;
+            Backtracker bt(s, 1, depth, budget);
+            if (!bt.solved) {
+                // search cut by the budget proves nothing
+                if (!budget.exhausted())
+                    failures.add_failure(s, focus, depth);
+                return false;
             }
+            solution = bt.solution;
+        } else {
+            solution.clear();
         }
+        return true;
+    };
 
-        cerr << "# "; debug(num_walls);
-        cerr << "# "; debug(num_balls);
-        int num_colors = ball_colors.size();
-        cerr << "# "; debug(num_colors);
+    vector<Move> solution;
+    if (solve(state, solution)) {
+        return {1, solution};
+    }
+    if (state.get_conflicts().empty())
+        return {0, vector<Move>()};
+
+    PackedCoord p = state.get_conflicts().front();
+    map<PackedCoord, CellSet> goals;
+    {
+        PartScope part_scope(PART_GOALS);
+        goals = state.rebuild_goals();
+    }
+    int max_stages = knobs.at("max_stages");
+    int num_candidates = knobs.at("stage_candidates");
+    vector<PackedCoord> waypoints;
+
+    // Brings a ball to a subgoal, then either solves the original goals or
+    // recurses with one stage less. Earlier waypoints are kept occupied
+    // until the final stage. Returns number of stages used (0 if failed)
+    // and the solution with later stages first, as Backtracker's
+    // solutions are backwards.
+    function<int(const Board&, int, vector<Move>&)> chain =
+        [&](const Board &board, int stages_left, vector<Move> &result) {
+        ProfileScope profile_stage_scope(
+            profile_stages[max_stages - stages_left + 1]);
+        auto subgoals = subgoal_candidates(board, goals, p, waypoints);
+        if (subgoals.size() > num_candidates)
+            subgoals.resize(num_candidates);
+        for (PackedCoord w : subgoals) {
+            if (budget.exhausted())
+                break;
 
-        int bucket = (1.0 * num_walls / (W * H) - 0.1) * 15;
-        if (bucket > 2) bucket = 2;
+            auto intermediate_goals = goals;
+            intermediate_goals.erase(p);
+            for (PackedCoord q : waypoints)
+                intermediate_goals[q] = CS_ANY_BALL;
+            intermediate_goals[w] = CS_ANY_BALL;
 
-        Board board = start;
+            State s1(board, intermediate_goals);
+            vector<Move> moves1;
+            if (!solve(s1, moves1))
+                continue;
 
-        draw_board([&](PackedCoord p) {
-            if (target[p] == WALL) {
-                ansi_style(DEFAULT_COLOR, true);
-                cerr << "    ";
+            Board board1 = board;
+            for (auto it = moves1.rbegin(); it != moves1.rend(); ++it)
+                apply_move(board1, reversed_move(*it));
+
+            int num_stages = 0;
+            State s2(board1, goals);
+            if (solve(s2, result)) {
+                num_stages = 2;
+            } else if (stages_left > 2) {
+                waypoints.push_back(w);
+                num_stages = chain(board1, stages_left - 1, result);
+                if (num_stages)
+                    num_stages++;
+                waypoints.pop_back();
+            }
+            if (num_stages) {
+                copy(moves1.begin(), moves1.end(), back_inserter(result));
+                return num_stages;
+            }
+        }
+        return 0;
+    };
+
+    vector<Move> result;
+    int num_stages = 0;
+    if (max_stages >= 2)
+        num_stages = chain(state.get_initial_board(), max_stages, result);
+    if (num_stages)
+        return {num_stages, result};
+    return {0, vector<Move>()};
+}
+
+
+// Rectangular window of the board around a cell, as a standalone board with
+// its own geometry. Padding ring keeps real walls; balls there become walls
+// too since a local solution never moves them, and empty cells become
+// FORBIDDEN so that nothing rolls out of the window or stops against them.
+class SubBoard {
+public:
+    int w, h;  // padded
+    Board board;
+    map<PackedCoord, CellSet> goals;
+
+    // Should be constructed in global geometry.
+    SubBoard(
+            const Board &global_board,
+            const map<PackedCoord, CellSet> &global_goals,
+            PackedCoord center, int radius) : global_w(::W) {
+        int cx = unpack_x(center);
+        int cy = unpack_y(center);
+        // padding ring included
+        x0 = max(1, cx - radius) - 1;
+        y0 = max(1, cy - radius) - 1;
+        int x1 = min(::W - 2, cx + radius) + 1;
+        int y1 = min(::H - 2, cy + radius) + 1;
+        w = x1 - x0 + 1;
+        h = y1 - y0 + 1;
+        whole = w == ::W && h == ::H;
+
+        board.resize(w * h);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                Cell c = global_board[pack(x0 + x, y0 + y)];
+                if (x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+                    if (c == EMPTY)
+                        c = FORBIDDEN;
+                    else if (is_ball(c))
+                        c = WALL;
+                }
+                board[x + y * w] = c;
+            }
+        }
+
+        for (auto kv : global_goals) {
+            PackedCoord p = to_local(kv.first);
+            if (p != -1 && board[p] != WALL && board[p] != FORBIDDEN)
+                goals[p] = kv.second;
+        }
+    }
+
+    bool covers_whole_board() const { return whole; }
+
+    // Both work in any geometry.
+    PackedCoord to_local(PackedCoord p) const {
+        int x = p % global_w - x0;
+        int y = p / global_w - y0;
+        if (x < 0 || y < 0 || x >= w || y >= h)
+            return -1;
+        return x + y * w;
+    }
+    PackedCoord to_global(PackedCoord p) const {
+        return (p % w + x0) + (p / w + y0) * global_w;
+    }
+
+private:
+    int global_w;
+    int x0, y0;
+    bool whole;
+};
+
+
+// Solves target p on a window around it and maps the solution back to
+// the full board. With fallback, failures are retried on the full board.
+pair<int, vector<Move>> windowed_multistep(
+        const Board &board, const map<PackedCoord, CellSet> &goals,
+        PackedCoord p, int depth, int radius, bool fallback,
+        SearchBudget &budget, FailureCache &failures) {
+    PartScope part_scope(PART_SEARCH);
+    if (radius > 0) {
+        SubBoard sub(board, goals, p, radius);
+        if (!sub.covers_whole_board()) {
+            pair<int, vector<Move>> res;
+            {
+                GeometryScope scope(sub.w, sub.h);
+                State state(sub.board, sub.goals);
+                res = multistep(state, depth, budget, failures);
+            }
+            for (auto &move : res.second)
+                move = {sub.to_global(move.first), sub.to_global(move.second)};
+            if (res.first || !fallback || budget.exhausted())
+                return res;
+        }
+    }
+    State state(board, goals);
+    return multistep(state, depth, budget, failures);
+}
+
+
+// Arguments of one windowed_multistep call, in the geometry of its board,
+// with what it took when captured and the knobs the search depends on.
+// One per record in the corpus file:
+//   subproblem w h p depth radius fallback max_nodes nodes time_ms stages
+//   knobs <name>=<value>...  (missing in older records)
+//   <board, w * h cells>
+//   <number of goals> <p cs>...
+struct Subproblem {
+    int w, h;
+    Board board;
+    map<PackedCoord, CellSet> goals;
+    PackedCoord p;
+    int depth;
+    int radius;
+    bool fallback;
+    int64_t max_nodes;
+
+    int64_t nodes;
+    double time;
+    int stages;
+
+    map<string, int> search_knobs;  // values of SEARCH_KNOBS
+
+    static const vector<string> SEARCH_KNOBS;
+
+    static map<string, int> current_search_knobs() {
+        map<string, int> result;
+        for (const auto &name : SEARCH_KNOBS)
+            result[name] = knobs.at(name);
+        return result;
+    }
+
+    void write(ostream &out) const {
+        out << "subproblem " << w << ' ' << h << ' ' << p << ' ' << depth
+            << ' ' << radius << ' ' << fallback << ' ' << max_nodes << ' '
+            << nodes << ' ' << int(time * 1000) << ' ' << stages << '\n';
+        out << "knobs";
+        for (const auto &kv : search_knobs)
+            out << ' ' << kv.first.c_str() << '=' << kv.second;
+        out << '\n';
+        out << string(board.begin(), board.end()).c_str() << '\n';
+        out << goals.size();
+        for (auto kv : goals)
+            out << ' ' << kv.first << ' ' << int(kv.second);
+        out << '\n';
+    }
+
+    // False at the end of input.
+    bool read(istream &in) {
+        string tag;
+        if (!(in >> tag))
+            return false;
+        assert(tag == "subproblem");
+        int time_ms;
+        in >> w >> h >> p >> depth >> radius >> fallback >> max_nodes
+           >> nodes >> time_ms >> stages;
+        time = time_ms * 1e-3;
+        string cells;
+        in >> cells;
+        search_knobs.clear();
+        if (cells == "knobs") {
+            string line;
+            getline(in, line);
+            istringstream knobs_in(line);
+            string knob;
+            while (knobs_in >> knob) {
+                int pos = knob.find('=');
+                assert(pos != string::npos);
+                search_knobs[knob.substr(0, pos)] = stoi(knob.substr(pos + 1));
+            }
+            in >> cells;
+        }
+        assert(cells.size() == w * h);
+        board.assign(cells.begin(), cells.end());
+        int num_goals;
+        in >> num_goals;
+        goals.clear();
+        for (int i = 0; i < num_goals; i++) {
+            PackedCoord q;
+            int cs;
+            in >> q >> cs;
+            goals[q] = CellSet(cs);
+        }
+        assert(in);
+        return true;
+    }
+};
+const vector<string> Subproblem::SEARCH_KNOBS = {
+    "max_stages", "stage_candidates", "move_ordering", "ordering_min_depth",
+    "matching_bound", "failure_window"};
+
+
+// Slow subproblems seen during the run, see capture_nodes and capture_ms.
+// main.cpp appends them to a file for replay.cpp.
+class SubproblemCorpus {
+public:
+    void add(const Subproblem &subproblem) {
+        ostringstream out;
+        subproblem.write(out);
+        lock_guard<mutex> lock(text_mutex);
+        text += out.str();
+        size++;
+    }
+
+    int get_size() {
+        lock_guard<mutex> lock(text_mutex);
+        return size;
+    }
+    string get_text() {
+        lock_guard<mutex> lock(text_mutex);
+        return text;
+    }
+
+private:
+    mutex text_mutex;
+    string text;
+    int size = 0;
+};
+
+SubproblemCorpus subproblem_corpus;
+
+
+// windowed_multistep that can be paused every so many nodes and resumed
+// later, so that searches for several targets can be interleaved. Runs
+// inline if the first step has no node limit, otherwise in a thread of
+// its own that only runs while step() waits for it.
+class SearchTask {
+public:
+    const Board board;
+    const map<PackedCoord, CellSet> goals;
+    const PackedCoord p;
+    const int depth;
+    const int radius;
+    const bool fallback;
+    SearchBudget budget;
+    vector<char> reserved;  // for reserved_balls, empty for none
+    pair<int, vector<Move>> result;
+    double time = 0;  // spent in step()
+
+    SearchTask(
+            const Board &board, const map<PackedCoord, CellSet> &goals,
+            PackedCoord p, int depth, int radius, bool fallback,
+            const SearchBudget &budget, FailureCache &failures)
+        : board(board), goals(goals), p(p),
+          depth(depth), radius(radius), fallback(fallback),
+          budget(budget), failures(failures), w(::W), h(::H) {
+        this->budget.on_pause = [this]() { pause(); };
+    }
+
+    ~SearchTask() {
+        if (!worker.joinable())
+            return;
+        if (!finished) {
+            // a search cut by the budget doesn't touch the failure cache
+            cancelled = true;
+            step(-1);
+        }
+        worker.join();
+    }
+
+    bool is_finished() const { return finished; }
+
+    // Searches for up to slice more nodes, or to the end if slice is
+    // negative. Returns whether the search is finished.
+    bool step(int64_t slice) {
+        assert(!finished);
+        double start = get_time();
+        if (slice < 0 && !worker.joinable()) {
+            search();
+        } else {
+            budget.pause_at = slice < 0 ? -1 : budget.nodes + slice;
+            unique_lock<mutex> lock(baton_mutex);
+            if (!worker.joinable())
+                worker = thread(&SearchTask::work, this);
+            running = true;
+            baton.notify_all();
+            baton.wait(lock, [this]() { return !running; });
+        }
+        time += get_time() - start;
+        return finished;
+    }
+
+private:
+    FailureCache &failures;
+    int w, h;
+    thread worker;
+    mutex baton_mutex;
+    condition_variable baton;
+    bool running = false;  // the worker has the baton
+    bool cancelled = false;
+    bool finished = false;
+
+    void search() {
+        reserved_balls = reserved.empty() ? nullptr : &reserved;
+        result = windowed_multistep(
+            board, goals, p, depth, radius, fallback, budget, failures);
+        reserved_balls = nullptr;
+        finished = true;
+    }
+
+    void work() {
+        set_geometry(w, h);
+        {
+            unique_lock<mutex> lock(baton_mutex);
+            baton.wait(lock, [this]() { return running; });
+        }
+        search();
+        lock_guard<mutex> lock(baton_mutex);
+        running = false;
+        baton.notify_all();
+    }
+
+    // On the worker, from budget.count_node().
+    void pause() {
+        PartScope::Idle idle;
+        unique_lock<mutex> lock(baton_mutex);
+        running = false;
+        baton.notify_all();
+        baton.wait(lock, [this]() { return running; });
+        if (cancelled)
+            budget.max_nodes = budget.nodes;
+    }
+};
+
+
+// Splits the time left between pending targets. Node rate and branching
+// factor are measured on the fly; each target gets a multiple of its fair
+// share of nodes, and the deepest depth that is expected to fit in it.
+class SearchScheduler {
+public:
+    SearchScheduler(double deadline, int max_depth, double slack)
+        : deadline(deadline), max_depth(max_depth), slack(slack) {}
+
+    SearchBudget budget(int targets_left) const {
+        double time_left = max(0.0, deadline - get_time());
+        double share = time_left * node_rate() / max(1, targets_left);
+        return SearchBudget(max<int64_t>(1000, slack * share));
+    }
+
+    int depth(const SearchBudget &budget) const {
+        double b = branching();
+        int depth = max_depth;
+        while (depth > 1 && depth * log(b) > log(budget.max_nodes))
+            depth--;
+        return depth;
+    }
+
+    void record(const SearchBudget &budget, double elapsed) {
+        total_nodes += budget.nodes;
+        total_time += elapsed;
+        log_branching += budget.log_branching;
+        num_branching_samples += budget.num_branching_samples;
+    }
+
+    double node_rate() const {
+        // guess until there is enough data
+        if (total_time < 0.05)
+            return 2e5;
+        return total_nodes / total_time;
+    }
+    double branching() const {
+        if (num_branching_samples == 0)
+            return 2.0;
+        return exp(log_branching / num_branching_samples);
+    }
+
+private:
+    double deadline;
+    int max_depth;
+    double slack;
+
+    int64_t total_nodes = 0;
+    double total_time = 0;
+    double log_branching = 0;
+    int num_branching_samples = 0;
+};
+
+
+void show_start_and_target(const Board &start, const Board &target) {
+    map<PackedCoord, CellSet> goal;
+    for (PackedCoord p = 0; p < start.size(); p++) {
+        if (is_ball(target[p]))
+            goal[p] = cell_to_cs(target[p]);
+    }
+    State state(start, goal);
+    state.show();
+}
+
+
+// One configuration of the placement loop.
+struct Strategy {
+    string name;
+    double blocking_penalty;
+    // how often targets are rescored, relative to the default (0 to never)
+    double rescore_rate;
+    int max_depth;
+    // generation 1: retry failed targets accepting a ball of any colour
+    bool any_ball_pass;
+    // 0 for the greedy loop
+    int beam_width;
+};
+
+
+// Variants for portfolio mode, the default one first.
+vector<Strategy> portfolio_strategies() {
+    double penalty = knobs.at("blocking_penalty");
+    int depth = knobs.at("max_depth");
+    int beam = knobs.at("beam_width");
+    return {
+        {"default", penalty, 1.0, depth, true, beam},
+        {"basin", 0.0, 1.0, depth - 1, true, 0},
+        {"blocking", 5 * penalty, 2.0, depth + 1, false, 0},
+        {"static", penalty, 0.0, depth, true, 0},
+        {"beam", penalty, 0.0, depth, true, beam ? beam : 4},
+    };
+}
+
+
+// Shortens a forward move sequence without changing the final board.
+// Looking at most 'lookahead' moves of the same ball ahead, a chain that
+// brings the ball back where it was is dropped, and otherwise the chain
+// is replaced by a single roll to the farthest position reachable
+// directly (gen_forward_rolls). Either is done only if no other move in
+// between touches (rolls through or stops against) the cells whose
+// occupancy changes, so everything else replays exactly as before.
+// Linear in the number of moves times the lookahead, give or take a log.
+vector<Move> optimize_moves(
+        const Board &start, const vector<Move> &moves, int lookahead) {
+    int n = moves.size();
+
+    // move indices, increasing
+    vector<vector<int>> touches(start.size());
+    vector<int> next_of_ball(n, -1);
+    {
+        vector<int> ball_at(start.size(), -1);
+        int num_balls = 0;
+        for (PackedCoord p = 0; p < start.size(); p++)
+            if (is_ball(start[p]))
+                ball_at[p] = num_balls++;
+        vector<int> last_move_of_ball(num_balls, -1);
+
+        for (int k = 0; k < n; k++) {
+            Move move = moves[k];
+            int d = move_dir(move);
+            for (PackedCoord p = move.first; p != move.second + d; p += d)
+                touches[p].push_back(k);
+            touches[move.second + d].push_back(k);
+
+            int ball = ball_at[move.first];
+            assert(ball != -1);
+            ball_at[move.first] = -1;
+            ball_at[move.second] = ball;
+            if (last_move_of_ball[ball] != -1)
+                next_of_ball[last_move_of_ball[ball]] = k;
+            last_move_of_ball[ball] = k;
+        }
+    }
+
+    vector<Move> result = moves;
+    vector<bool> alive(n, true);
+
+    // Whether some live move between i and j, other than the ones in chain,
+    // touches any of the cells.
+    auto disturbed = [&](
+            int i, int j,
+            const vector<PackedCoord> &cells, const vector<int> &chain) {
+        for (PackedCoord c : cells) {
+            const auto &t = touches[c];
+            for (auto it = upper_bound(t.begin(), t.end(), i);
+                 it != t.end() && *it < j; ++it) {
+                if (alive[*it] && find(chain.begin(), chain.end(), *it) == chain.end())
+                    return true;
+            }
+        }
+        return false;
+    };
+
+    Board board = start;
+    for (int i = 0; i < n; i++) {
+        bool changed = true;
+        while (alive[i] && changed) {
+            changed = false;
+            PackedCoord from = result[i].first;
+
+            // this ball's moves from now on, and where they leave it
+            vector<int> chain = {i};
+            while (chain.size() < lookahead && next_of_ball[chain.back()] != -1)
+                chain.push_back(next_of_ball[chain.back()]);
+            vector<PackedCoord> cells = {from};
+            for (int k : chain)
+                cells.push_back(result[k].second);
+
+            for (int m = chain.size() - 1; m >= 1 && !changed; m--) {
+                vector<int> sub_chain(chain.begin(), chain.begin() + m + 1);
+                vector<PackedCoord> sub_cells(cells.begin(), cells.begin() + m + 2);
+                PackedCoord to = cells[m + 1];
+
+                if (to == from) {
+                    if (disturbed(i, chain[m], sub_cells, sub_chain))
+                        continue;
+                    for (int k : sub_chain)
+                        alive[k] = false;
+                    changed = true;
+                    continue;
+                }
+
+                auto tos = gen_forward_rolls_vector(from, board);
+                if (find(tos.begin(), tos.end(), to) == tos.end())
+                    continue;
+                if (disturbed(i, chain[m], sub_cells, sub_chain))
+                    continue;
+                result[i] = {from, to};
+                for (int k = 1; k <= m; k++)
+                    alive[chain[k]] = false;
+                next_of_ball[i] = next_of_ball[chain[m]];
+                changed = true;
+            }
+        }
+        if (alive[i])
+            apply_move(board, result[i]);
+    }
+
+    vector<Move> optimized;
+    for (int i = 0; i < n; i++)
+        if (alive[i])
+            optimized.push_back(result[i]);
+
+#ifndef NDEBUG
+    Board expected = start;
+    for (auto move : moves)
+        apply_move(expected, move);
+    assert(board == expected);
+#endif
+    return optimized;
+}
+
+
+// Fraction of achieved target cells, half a point for a ball of wrong
+// colour (same metric as the tester).
+// target_balls is the index of target.
+double placement_score(
+        const Board &board, const Board &target, const BallIndex &target_balls) {
+    double score = 0.0;
+    target_balls.for_each_ball([&](PackedCoord p) {
+        if (board[p] == target[p])
+            score += 1.0;
+        else if (is_ball(board[p]))
+            score += 0.5;
+    });
+    int num_balls = target_balls.num_balls();
+    if (num_balls > 0)
+        score /= num_balls;
+    return score;
+}
+
+
+// As expected by the tester (no border, directions are numbered from
+// left clockwise).
+string format_move(Move move) {
+    int dir = move_dir(move);
+    if (dir == -::W) {
+        dir = 3;
+    } else if (dir == -1) {
+        dir = 0;
+    } else if (dir == 1) {
+        dir = 2;
+    } else if (dir == ::W) {
+        dir = 1;
+    } else {
+        assert(false);
+    }
+    ostringstream out;
+    out << unpack_y(move.first) - 1 << ' '
+        << unpack_x(move.first) - 1 << ' '
+        << dir;
+    return out.str();
+}
+
+
+// Best answer so far, already in the output format, for when the process
+// has to stop before restorePattern returns (main.cpp flushes it on
+// signals and from the watchdog). Solvers offer move lists as they go.
+// flush() does nothing but write(2) and can be called from a signal
+// handler; once it has started, offers are ignored, so the buffer it
+// writes is never touched.
+class Checkpoint {
+public:
+    // Keeps the moves if they score better, or as well with fewer moves.
+    void offer(double score, const vector<Move> &moves) {
+        lock_guard<mutex> lock(offer_mutex);
+        if (active >= 0 && (score < best_score ||
+                            (score == best_score &&
+                             moves.size() >= best_size)))
+            return;
+        vector<string> lines;
+        for (auto move : moves)
+            lines.push_back(format_move(move));
+        store(lines);
+        best_score = score;
+        best_size = moves.size();
+    }
+
+    // Unconditionally, for the final answer.
+    void set(const vector<string> &lines) {
+        lock_guard<mutex> lock(offer_mutex);
+        store(lines);
+        best_score = 2.0;
+        best_size = lines.size();
+    }
+
+    // Writes the answer (empty if nothing was offered) once.
+    void flush(int fd) {
+        if (flushed.exchange(true))
+            return;
+        int a = active.load();
+        const string &text = a >= 0 ? buffers[a] : empty_answer;
+        size_t written = 0;
+        while (written < text.size()) {
+            ssize_t n = ::write(fd, text.data() + written, text.size() - written);
+            if (n <= 0)
+                break;
+            written += n;
+        }
+    }
+
+private:
+    mutex offer_mutex;
+    string buffers[2];
+    atomic<int> active{-1};
+    atomic<bool> flushed{false};
+    double best_score = -1;
+    size_t best_size = 0;
+    const string empty_answer = "0\n";
+
+    void store(const vector<string> &lines) {
+        if (flushed.load())
+            return;
+        int next = active.load() == 0 ? 1 : 0;
+        ostringstream out;
+        out << lines.size() << '\n';
+        for (const auto &line : lines)
+            out << line.c_str() << '\n';
+        buffers[next] = out.str();
+        active.store(next);
+    }
+};
+
+Checkpoint checkpoint;
+
+
+// Computes basin scores of pending targets in a background thread while
+// the foreground searches. Jobs are tagged with the epoch of the achieved
+// goals they were computed against; take() discards everything for other
+// epochs, so the foreground only gets scores it would have computed
+// itself.
+class ScorePipeline {
+public:
+    int64_t hits = 0;
+    int64_t misses = 0;
+
+    ScorePipeline(const Board &target, const BallIndex &target_balls)
+        : target(target), target_balls(target_balls),
+          worker(&ScorePipeline::work, this, ::W, ::H) {}
+
+    ~ScorePipeline() {
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            stopping = true;
+            cancel_running = true;
+        }
+        jobs_changed.notify_all();
+        worker.join();
+    }
+
+    // Replaces queued jobs with ones scoring targets against each of the
+    // (epoch, achieved goals) variants, in order.
+    void post(
+            const vector<pair<int, map<PackedCoord, CellSet>>> &variants,
+            const vector<PackedCoord> &targets) {
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            queue.clear();
+            for (const auto &variant : variants)
+                queue.push_back(Job{variant.first, variant.second, targets, {}});
+        }
+        jobs_changed.notify_all();
+    }
+
+    // Scores for targets at epoch, if a job for them was posted; waits for
+    // it to finish if needed.
+    bool take(
+            int epoch, const vector<PackedCoord> &targets,
+            vector<double> &scores) {
+        unique_lock<mutex> lock(jobs_mutex);
+        auto stale = [epoch](const Job &job) { return job.epoch != epoch; };
+        queue.erase(remove_if(queue.begin(), queue.end(), stale), queue.end());
+        done.erase(remove_if(done.begin(), done.end(), stale), done.end());
+        if (running && running_epoch != epoch)
+            cancel_running = true;
+        auto pending = [&]() {
+            return (running && running_epoch == epoch) || !queue.empty();
+        };
+        jobs_changed.wait(lock, [&]() { return !pending() || !done.empty(); });
+
+        bool found = false;
+        for (auto &job : done) {
+            if (job.targets == targets) {
+                scores = job.scores;
+                found = true;
+            }
+        }
+        done.clear();
+        queue.clear();
+        if (found)
+            hits++;
+        else
+            misses++;
+        return found;
+    }
+
+private:
+    struct Job {
+        int epoch;
+        map<PackedCoord, CellSet> achieved;
+        vector<PackedCoord> targets;
+        vector<double> scores;
+    };
+
+    const Board &target;
+    const BallIndex &target_balls;
+    mutex jobs_mutex;
+    condition_variable jobs_changed;
+    deque<Job> queue;
+    vector<Job> done;
+    bool running = false;
+    int running_epoch = -1;
+    atomic<bool> cancel_running{false};
+    bool stopping = false;
+    thread worker;  // last, it starts in the constructor
+
+    void work(int w, int h) {
+        set_geometry(w, h);
+        unique_lock<mutex> lock(jobs_mutex);
+        while (true) {
+            jobs_changed.wait(lock, [this]() {
+                return stopping || !queue.empty();
+            });
+            if (stopping)
                 return;
+            Job job = queue.front();
+            queue.pop_front();
+            running = true;
+            running_epoch = job.epoch;
+            cancel_running = false;
+            lock.unlock();
+
+            for (PackedCoord p : job.targets) {
+                if (cancel_running)
+                    break;
+                job.scores.push_back(
+                    basin_score(target, target_balls, p, job.achieved));
             }
-            if (is_ball(target[p]))
-                ansi_style(GREEN);
-            cerr << setw(4) << (int)basin_score(target, p, {});
 
-        });
+            lock.lock();
+            running = false;
+            if (!cancel_running)
+                done.push_back(job);
+            jobs_changed.notify_all();
+        }
+    }
+};
+
+
+// Routes balls to several targets at once, in the spirit of prioritized
+// multi-agent path finding over the roll graph. Targets are planned one
+// after another on the board with the earlier routes already applied, so
+// a route can use balls placed before it as stoppers and lanes they left
+// free. A target no ball can reach directly may first have one other ball
+// rolled out of the way: one next to it in a lane into the target, or the
+// one sitting on it.
+//
+// Each step routes every target still pending on the current board; these
+// tentative routes make up the reservation table: cells they need empty
+// (lanes) and occupied (stoppers). The first target by priority whose
+// route fills no lane and vacates no stopper of the others goes next (or
+// the first one routed, if each conflicts), so the ones that follow can
+// still come. Balls once routed stay put, and so do balls that aren't.
+class RoutePlanner {
+public:
+    struct Route {
+        PackedCoord target;
+        PackedCoord ball;  // start of the routed ball
+        vector<Move> moves;  // forward, clearing move first if any
+    };
+
+    // Targets are by decreasing priority. accept(target, ball, color) says
+    // which balls may be routed to target and prefer(target, ball, color)
+    // which ones are better left where they are (see route_ball); balls
+    // that aren't preferred are never cleared away. Returns routes that
+    // apply to board one after another, in that order.
+    template<class Accept, class Prefer>
+    static vector<Route> plan(
+            const Board &board, const vector<PackedCoord> &targets,
+            Accept accept, Prefer prefer) {
+        Board b = board;
+        vector<char> placed(board.size(), false);
+        vector<PackedCoord> pending = targets;
+        vector<Route> result;
+        while (!pending.empty()) {
+            vector<Route> routes;
+            for (PackedCoord p : pending)
+                routes.push_back(route(b, p, placed, accept, prefer));
+
+            map<PackedCoord, Reservation> table;
+            for (int i = 0; i < routes.size(); i++)
+                reserve(b, routes[i], i, table);
+
+            int next = -1;
+            for (int i = 0; i < routes.size(); i++) {
+                if (routes[i].moves.empty())
+                    continue;
+                if (next == -1)
+                    next = i;
+                if (!conflicts(b, routes[i], i, table)) {
+                    next = i;
+                    break;
+                }
+            }
+            if (next == -1)
+                break;
+
+            const Route &r = routes[next];
+            bool applied = try_apply_moves(b, r.moves);
+            assert(applied);
+            placed[r.target] = true;
+            result.push_back(r);
+            pending.erase(pending.begin() + next);
+        }
+        return result;
+    }
+
+private:
+    struct Reservation {
+        vector<int> lane_of;
+        vector<int> stopper_of;
+    };
+
+    // Empty moves if none.
+    template<class Accept, class Prefer>
+    static Route route(
+            const Board &b, PackedCoord p, const vector<char> &placed,
+            Accept accept, Prefer prefer) {
+        Route result;
+        result.target = p;
+        auto may_come = [&](const Board &bb, PackedCoord q) {
+            return !placed[q] && accept(p, q, bb[q]);
+        };
+        if (b[p] == EMPTY) {
+            auto backward = route_ball(
+                b, p,
+                [&](PackedCoord q) { return may_come(b, q); },
+                [&](PackedCoord q) { return prefer(p, q, b[q]); });
+            if (!backward.empty()) {
+                set_moves(result, {}, backward);
+                return result;
+            }
+        }
+
+        // clear the way
+        vector<PackedCoord> blockers;
+        if (b[p] != EMPTY) {
+            blockers.push_back(p);
+        } else {
+            for (int d : DIRS) {
+                PackedCoord q = p + d;
+                while (b[q] == EMPTY)
+                    q += d;
+                blockers.push_back(q);
+            }
+        }
+        for (PackedCoord q : blockers) {
+            if (!is_ball(b[q]) || placed[q] || !prefer(p, q, b[q]))
+                continue;
+            for (PackedCoord to : gen_forward_rolls_vector(q, b)) {
+                Board bb = b;
+                apply_move(bb, {q, to});
+                if (bb[p] != EMPTY)
+                    continue;
+                auto backward = route_ball(
+                    bb, p,
+                    [&](PackedCoord qq) { return may_come(bb, qq); },
+                    [&](PackedCoord qq) { return prefer(p, qq, bb[qq]); });
+                if (!backward.empty()) {
+                    set_moves(result, {{q, to}}, backward);
+                    return result;
+                }
+            }
+        }
+        return result;
+    }
+
+    static void set_moves(
+            Route &route, vector<Move> clearing, const vector<Move> &backward) {
+        route.ball = backward.back().second;
+        route.moves = clearing;
+        for (auto it = backward.rbegin(); it != backward.rend(); ++it)
+            route.moves.push_back(reversed_move(*it));
+    }
+
+    static void reserve(
+            const Board &b, const Route &route, int i,
+            map<PackedCoord, Reservation> &table) {
+        for (auto move : route.moves) {
+            int d = move_dir(move);
+            for (PackedCoord q = move.first + d; q != move.second + d; q += d)
+                table[q].lane_of.push_back(i);
+            if (is_ball(b[move.second + d]))
+                table[move.second + d].stopper_of.push_back(i);
+        }
+    }
+
+    // Whether route i leaves a ball in a lane of another route or takes
+    // one away from its stopper.
+    static bool conflicts(
+            const Board &b, const Route &route, int i,
+            const map<PackedCoord, Reservation> &table) {
+        Board bb = b;
+        bool applied = try_apply_moves(bb, route.moves);
+        assert(applied);
+        for (const auto &kv : table) {
+            bool now = is_ball(b[kv.first]);
+            bool then = is_ball(bb[kv.first]);
+            if (now == then)
+                continue;
+            for (int j : then ? kv.second.lane_of : kv.second.stopper_of)
+                if (j != i)
+                    return true;
+        }
+        return false;
+    }
+};
+
+
+// Common part of the placement loops. Each works on its own board copy,
+// so several can run in parallel (each thread has to set up the geometry
+// first).
+class Solver {
+public:
+    const Strategy strategy;
+    Board board;
+    vector<Move> moves;
+    double score = 0;
+    ostringstream log;
+    int moves_saved = 0;
+    int num_checkpoints = 0;
+    int64_t pipeline_hits = 0;
+    int64_t pipeline_misses = 0;
+    int num_routed = 0;
+
+    FailureCache failures;
+    SearchScheduler scheduler;
+
+    Solver(
+            const Board &start, const Board &target,
+            const Strategy &strategy, double deadline)
+        : strategy(strategy), board(start),
+          failures(knobs.at("failure_window")),
+          scheduler(deadline, strategy.max_depth, knobs.at("budget_slack")),
+          start(start), target(target), target_balls(target),
+          deadline(deadline), goal_graph(target) {
+        checkpoint_interval = knobs.at("checkpoint_ms") * 1e-3;
+        next_checkpoint = get_time() + checkpoint_interval;
+        num_balls = 0;
+        for (Cell c : target)
+            if (is_ball(c))
+                num_balls++;
+    }
+    virtual ~Solver() {}
+
+    virtual void run() = 0;
+
+protected:
+    const Board &start;
+    const Board &target;
+    const BallIndex target_balls;
+    double deadline;
+    int num_balls;
+    GoalGraph goal_graph;
+    double checkpoint_interval;
+    double next_checkpoint;
+
+    // Replaces basin priorities with positions in the blocking-aware
+    // order, so that the next target is still at the back.
+    void reorder(vector<pair<double, PackedCoord>> &targets) const {
+        auto order = goal_graph.order(targets, strategy.blocking_penalty);
+        for (int i = 0; i < order.size(); i++)
+            targets[i] = {-i, order[i]};
+        sort(targets.begin(), targets.end());
+    }
+
+    // Budgeted multistep for target p on the given board, to be run with
+    // step() and passed to end_target() when finished.
+    unique_ptr<SearchTask> start_target(
+            const Board &board, const map<PackedCoord, CellSet> &goal,
+            PackedCoord p, int targets_left) {
+        auto budget = scheduler.budget(targets_left);
+        int depth = scheduler.depth(budget);
+        return unique_ptr<SearchTask>(new SearchTask(
+            board, goal, p, depth,
+            knobs.at("solve_window"), knobs.at("window_fallback"),
+            budget, failures));
+    }
+
+    void end_target(const SearchTask &task) {
+        assert(task.is_finished());
+        scheduler.record(task.budget, task.time);
+
+        int capture_nodes = knobs.at("capture_nodes");
+        int capture_ms = knobs.at("capture_ms");
+        if ((capture_nodes > 0 && task.budget.nodes >= capture_nodes) ||
+            (capture_ms > 0 && task.time * 1000 >= capture_ms)) {
+            Subproblem subproblem{
+                ::W, ::H, task.board, task.goals, task.p,
+                task.depth, task.radius, task.fallback,
+                task.budget.max_nodes, task.budget.nodes, task.time,
+                task.result.first, Subproblem::current_search_knobs()};
+            subproblem_corpus.add(subproblem);
+        }
+    }
+
+    // Whole search for target p at once.
+    pair<int, vector<Move>> solve_target(
+            const Board &board, const map<PackedCoord, CellSet> &goal,
+            PackedCoord p, int targets_left, SearchBudget &budget) {
+        auto task = start_target(board, goal, p, targets_left);
+        task->step(-1);
+        end_target(*task);
+        budget = task->budget;
+        budget.on_pause = nullptr;  // refers to the task
+        return task->result;
+    }
+
+    // Offers moves that lead to board to the checkpoint, at most once per
+    // checkpoint_ms unless forced. Past the cap only a prefix is valid.
+    void save_checkpoint(
+            const Board &board, const vector<Move> &moves, bool force = false) {
+        double now = get_time();
+        if (!force && now < next_checkpoint)
+            return;
+        next_checkpoint = now + checkpoint_interval;
+        num_checkpoints++;
+        if (moves.size() <= 20 * num_balls) {
+            checkpoint.offer(placement_score(board, target, target_balls), moves);
+            return;
+        }
+        vector<Move> prefix(moves.begin(), moves.begin() + 20 * num_balls);
+        Board b = start;
+        for (auto move : prefix)
+            apply_move(b, move);
+        checkpoint.offer(placement_score(b, target, target_balls), prefix);
+    }
+
+    // Runs optimize_moves on the committed moves.
+    void optimize() {
+        int lookahead = knobs.at("optimize_lookahead");
+        if (lookahead < 2)
+            return;
+        static const int profile = profile_tag("optimize");
+        ProfileScope profile_scope(profile);
+        int old_size = moves.size();
+        moves = optimize_moves(start, moves, lookahead);
+        moves_saved += old_size - moves.size();
+    }
+
+    // Whatever doesn't fit is cut off by the tester anyway, so score
+    // what will actually be there.
+    void finish() {
+        optimize();
+        if (moves.size() > 20 * num_balls) {
+            moves.resize(20 * num_balls);
+            board = start;
+            for (auto move : moves)
+                apply_move(board, move);
+        }
+        score = placement_score(board, target, target_balls);
+        save_checkpoint(board, moves, true);
+    }
+};
 
+
+// Places targets one by one, committing each solution, until time or
+// moves run out.
+class GreedySolver : public Solver {
+public:
+    GreedySolver(
+            const Board &start, const Board &target,
+            const Strategy &strategy, double deadline, int bucket)
+        : Solver(start, target, strategy, deadline), bucket(bucket),
+          board_balls(start) {}
+
+    void run() override {
+        static const int profile = profile_tag("greedy");
+        static const ProfileTagFamily profile_generations("generation_", 2);
+        ProfileScope profile_scope(profile);
+        if (knobs.at("score_pipeline") > 0)
+            pipeline.reset(new ScorePipeline(target, target_balls));
+        if (knobs.at("assignment")) {
+            assignment.reset(
+                new BallAssignment(target, knobs.at("assignment_exact")));
+        }
         map<PackedCoord, CellSet> achieved;
-        for (int generation = 0; generation < 2; generation++) {
+        int num_generations = strategy.any_ball_pass ? 2 : 1;
+        for (int generation = 0; generation < num_generations; generation++) {
+            ProfileScope profile_generation_scope(
+                profile_generations[generation]);
 
             vector<pair<double, PackedCoord>> prioritized_targets;
-            for (PackedCoord p = 0; p < board.size(); p++) {
-                if (is_ball(target[p]) && achieved.count(p) == 0) {
+            target_balls.for_each_ball([&](PackedCoord p) {
+                if (achieved.count(p) == 0) {
                     prioritized_targets.emplace_back(
-                        -basin_score(target, p, achieved), p);
+                        -basin_score(target, target_balls, p, achieved), p);
                 }
+            });
+            steer(prioritized_targets, achieved);
+            reorder(prioritized_targets);
+
+            int rescore_period = 0;
+            if (bucket < 2 && strategy.rescore_rate > 0) {
+                int divisor = knobs.at(
+                    bucket ? "rescore_divisor_walls" : "rescore_divisor");
+                rescore_period = num_balls /
+                    (divisor * strategy.rescore_rate) + 1;
             }
-            sort(prioritized_targets.begin(), prioritized_targets.end());
 
             string pattern;
             int step = 0;
             int num_tasks = 0;
             int num_solved = 0;
-            while (!prioritized_targets.empty()) {
-                if (bucket < 2 && ++step % (num_balls / (bucket ? 10 : 5) + 1) == 0) {
-                    for (auto &t : prioritized_targets)
-                        t.first = -basin_score(target, t.second, achieved);
-                    sort(prioritized_targets.begin(), prioritized_targets.end());
+            // Targets that ran out of budget are retried once the rest is
+            // done, with the time that is left.
+            vector<pair<double, PackedCoord>> parked;
+            bool parked_pass = false;
+            int optimized_size = 0;
+            // Up to interleave targets are searched at once, each on the
+            // board as it was when it started. The one that used the fewest
+            // nodes gets the next slice, so easy targets finish first.
+            int interleave = max(1, knobs.at("interleave"));
+            int64_t slice = interleave > 1 ? knobs.at("interleave_slice") : -1;
+            bool reserve =
+                assignment != nullptr && knobs.at("assignment_reserve");
+            int route_batch = knobs.at("route_batch");
+            vector<ActiveTarget> active;
+            while (true) {
+                if (prioritized_targets.empty() && active.empty()) {
+                    if (parked_pass || parked.empty())
+                        break;
+                    parked_pass = true;
+                    prioritized_targets = parked;
+                    pattern += '|';
                 }
-
-                auto t = prioritized_targets.back();
-                prioritized_targets.pop_back();
-                PackedCoord p = t.second;
-                assert(achieved.count(p) == 0);
-                // TODO: more fine-grained timeout (inside rec)
-                if (get_time() > start_time + TIME_LIMIT) {
-                    cerr << "TIMEOUT" << endl;
+                if (moves.size() >= 20 * num_balls) {
+                    if (moves.size() > optimized_size) {
+                        optimize();
+                        optimized_size = moves.size();
+                        continue;
+                    }
+                    log << "OUT OF MOVES" << endl;
+                    break;
+                }
+                if (get_time() > deadline) {
+                    log << "TIMEOUT" << endl;
                     break;
                 }
 
-                auto current_goal = achieved;
-                assert(is_ball(target[p]));
-                if (generation == 0)
-                    current_goal[p] = cell_to_cs(target[p]);
-                else
-                    current_goal[p] = CS_ANY_BALL;
+                if (active.size() < interleave && !prioritized_targets.empty()) {
+                    if (!parked_pass && rescore_period &&
+                        ++step % rescore_period == 0) {
+                        rescore(prioritized_targets, achieved);
+                        steer(prioritized_targets, achieved);
+                        reorder(prioritized_targets);
+                    }
 
-                State state(board, current_goal);
-                auto res = multistep(state, 6);
+                    // targets in flight notice moved balls through epoch
+                    if (route_batch > 0) {
+                        int n = route(
+                            prioritized_targets, achieved, generation,
+                            route_batch);
+                        if (n > 0) {
+                            num_tasks += n;
+                            num_solved += n;
+                            pattern += string(n, 'R');
+                            continue;
+                        }
+                    }
+
+                    auto t = prioritized_targets.back();
+                    prioritized_targets.pop_back();
+                    PackedCoord p = t.second;
+                    assert(achieved.count(p) == 0);
+
+                    auto current_goal = achieved;
+                    assert(is_ball(target[p]));
+                    if (generation == 0)
+                        current_goal[p] = cell_to_cs(target[p]);
+                    else
+                        current_goal[p] = CS_ANY_BALL;
+
+                    // next rescore is against either outcome
+                    if (pipeline != nullptr && !parked_pass && rescore_period &&
+                        (step + 1) % rescore_period == 0 &&
+                        !prioritized_targets.empty()) {
+                        auto if_solved = achieved;
+                        if_solved[p] = current_goal[p];
+                        pipeline->post(
+                            {{epoch + 1, if_solved}, {epoch, achieved}},
+                            positions(prioritized_targets));
+                    }
+
+                    int targets_left =
+                        prioritized_targets.size() + active.size() + 1;
+                    if (!parked_pass)
+                        targets_left += parked.size();
+                    active.push_back(ActiveTarget{
+                        t, start_target(board, current_goal, p, targets_left),
+                        epoch});
+                    if (reserve)
+                        active.back().task->reserved =
+                            assignment->reserved_except(p);
+                    continue;
+                }
+
+                int i = 0;
+                for (int j = 1; j < active.size(); j++)
+                    if (active[j].task->budget.nodes < active[i].task->budget.nodes)
+                        i = j;
+                ActiveTarget &a = active[i];
+                if (a.epoch != epoch && a.task->budget.nodes < slice) {
+                    // cheap to redo against the current board
+                    PackedCoord p = a.task->p;
+                    auto goal = achieved;
+                    goal[p] = a.task->goals.at(p);
+                    int targets_left = prioritized_targets.size() + active.size();
+                    if (!parked_pass)
+                        targets_left += parked.size();
+                    a.task = start_target(board, goal, p, targets_left);
+                    a.epoch = epoch;
+                    if (reserve)
+                        a.task->reserved = assignment->reserved_except(p);
+                }
+                if (!a.task->step(slice))
+                    continue;
+                ActiveTarget done = move(active[i]);
+                active.erase(active.begin() + i);
+                const SearchTask &task = *done.task;
+                end_target(task);
+                PackedCoord p = task.p;
+                auto res = task.result;
+
+                if (!res.first && task.budget.exhausted() && !parked_pass) {
+                    parked.push_back(done.target);
+                    pattern += 'p';
+                    continue;
+                }
+
+                vector<Move> sol;
+                for (auto it = res.second.rbegin(); it != res.second.rend(); ++it)
+                    sol.push_back(reversed_move(*it));
+                if (res.first && done.epoch != epoch) {
+                    // other targets were placed since it started
+                    Board b = board;
+                    auto goal = achieved;
+                    goal[p] = task.goals.at(p);
+                    if (!try_apply_moves(b, sol) || !satisfies(b, goal)) {
+                        prioritized_targets.push_back(done.target);
+                        pattern += 'r';
+                        continue;
+                    }
+                }
 
                 num_tasks++;
                 if (res.first) {
                     num_solved++;
-                    achieved[p] = current_goal[p];
-                    auto sol = res.second;
-                    reverse(sol.begin(), sol.end());
+                    achieved[p] = task.goals.at(p);
+                    epoch++;
                     for (auto move : sol) {
-                        move = reversed_move(move);
-                        apply_move(board, move);
-                        result.push_back(format_move(move));
+                        apply_move(board, board_balls, move);
+                        moves.push_back(move);
                     }
+                    save_checkpoint(board, moves);
                     pattern += '0' + res.first;
                 } else {
-                    // if (generation == 0) {
-                    //     state.show();
-                    //     cerr << "---------------------" << endl;
-                    // }
                     pattern += ".";
                 }
             }
-            debug2(num_tasks, num_solved);
-            debug(pattern);
+            log << "num_tasks = " << num_tasks
+                << ", num_solved = " << num_solved << endl;
+            log << "pattern = " << pattern << endl;
+        }
+        if (pipeline != nullptr) {
+            pipeline_hits = pipeline->hits;
+            pipeline_misses = pipeline->misses;
+            pipeline.reset();
         }
+        finish();
+    }
+
+private:
+    int bucket;
+    BallIndex board_balls;
+    unique_ptr<ScorePipeline> pipeline;
+    unique_ptr<BallAssignment> assignment;
+    int epoch = 0;  // number of changes to achieved goals
+
+    struct ActiveTarget {
+        pair<double, PackedCoord> target;
+        unique_ptr<SearchTask> task;
+        int epoch;  // when started
+    };
+
+    static bool satisfies(
+            const Board &board, const map<PackedCoord, CellSet> &goals) {
+        for (auto kv : goals) {
+            Cell c = board[kv.first];
+            if (!is_ball(c) ||
+                (kv.second != CS_ANY_BALL && cell_to_cs(c) != kv.second))
+                return false;
+        }
+        return true;
+    }
+
+    static vector<PackedCoord> positions(
+            const vector<pair<double, PackedCoord>> &targets) {
+        vector<PackedCoord> result;
+        for (const auto &t : targets)
+            result.push_back(t.second);
+        return result;
+    }
+
+    // Rematches balls and postpones targets whose ball is farther.
+    void steer(
+            vector<pair<double, PackedCoord>> &targets,
+            const map<PackedCoord, CellSet> &achieved) {
+        if (assignment == nullptr)
+            return;
+        assignment->update(board_balls, achieved);
+        int weight = knobs.at("assignment_weight");
+        for (auto &t : targets)
+            t.first -= weight * assignment->cost(t.second);
+    }
+
+    // Commits RoutePlanner routes for the next batch targets and drops
+    // them from targets; returns how many.
+    int route(
+            vector<pair<double, PackedCoord>> &targets,
+            map<PackedCoord, CellSet> &achieved, int generation, int batch) {
+        vector<PackedCoord> batch_targets;
+        for (int i = 0; i < batch && i < targets.size(); i++)
+            batch_targets.push_back(targets[targets.size() - 1 - i].second);
+
+        auto routes = RoutePlanner::plan(
+            board, batch_targets,
+            [&](PackedCoord p, PackedCoord ball, Cell color) {
+                return achieved.count(ball) == 0 &&
+                    (generation > 0 || color == target[p]);
+            },
+            [&](PackedCoord, PackedCoord ball, Cell color) {
+                // leave balls that are already where they belong, achieved
+                // ones included
+                return !is_ball(target[ball]) ||
+                    (generation == 0 && color != target[ball]);
+            });
+
+        int n = 0;
+        for (const auto &route : routes) {
+            if (moves.size() + route.moves.size() > 20 * num_balls)
+                break;
+            for (auto move : route.moves) {
+                apply_move(board, board_balls, move);
+                moves.push_back(move);
+            }
+            achieved[route.target] =
+                generation == 0 ? cell_to_cs(target[route.target]) : CS_ANY_BALL;
+            epoch++;
+            n++;
+            for (int i = 0; i < targets.size(); i++) {
+                if (targets[i].second == route.target) {
+                    targets.erase(targets.begin() + i);
+                    break;
+                }
+            }
+        }
+        if (n > 0)
+            save_checkpoint(board, moves);
+        num_routed += n;
+        return n;
+    }
+
+    // Basin scores against achieved, from the pipeline if it has them.
+    void rescore(
+            vector<pair<double, PackedCoord>> &targets,
+            const map<PackedCoord, CellSet> &achieved) {
+        vector<double> scores;
+        if (pipeline != nullptr &&
+            pipeline->take(epoch, positions(targets), scores)) {
+            for (int i = 0; i < targets.size(); i++)
+                targets[i].first = -scores[i];
+            return;
+        }
+        for (auto &t : targets)
+            t.first = -basin_score(target, target_balls, t.second, achieved);
+    }
+};
+
+
+// Persistent list of moves, newest first. Beam nodes share the common
+// prefix of their histories instead of copying it.
+struct MoveLog {
+    Move move;
+    shared_ptr<const MoveLog> prev;
+
+    static shared_ptr<const MoveLog> append(
+            shared_ptr<const MoveLog> log, Move move) {
+        return make_shared<const MoveLog>(MoveLog{move, log});
+    }
+    static vector<Move> to_vector(const MoveLog *log) {
+        vector<Move> result;
+        for (; log != nullptr; log = log->prev.get())
+            result.push_back(log->move);
+        reverse(result.begin(), result.end());
+        return result;
+    }
+};
+
+
+// Keeps the beam_width best partial placements instead of committing to
+// each solved target. Every step expands each of them with the next few
+// targets in blocking-aware basin order; results are deduplicated by
+// board and ranked by placement_score, then by number of moves.
+class BeamSolver : public Solver {
+public:
+    BeamSolver(
+            const Board &start, const Board &target,
+            const Strategy &strategy, double deadline)
+        : Solver(start, target, strategy, deadline) {}
+
+    void run() override {
+        static const int profile = profile_tag("beam");
+        ProfileScope profile_scope(profile);
+        vector<pair<double, PackedCoord>> prioritized_targets;
+        target_balls.for_each_ball([&](PackedCoord p) {
+            prioritized_targets.emplace_back(
+                -basin_score(target, target_balls, p, {}), p);
+        });
+        reorder(prioritized_targets);
+        reverse(prioritized_targets.begin(), prioritized_targets.end());
+        for (auto t : prioritized_targets)
+            order.push_back(t.second);
+
+        vector<Node> beam(1);
+        beam[0].board = start;
+        beam[0].num_moves = 0;
+        beam[0].generation = 0;
+        beam[0].score = placement_score(start, target, target_balls);
+
+        int branching = knobs.at("beam_branching");
+        int num_steps = 0;
+        int num_searches = 0;
+        int num_pruned = 0;
+        while (get_time() < deadline) {
+            int targets_left = 0;
+            for (auto &node : beam) {
+                next_targets(node, 1);  // to switch generation if needed
+                targets_left = max(targets_left, pending_count(node));
+            }
+            if (targets_left == 0)
+                break;
+            // fair share is per search, and each step runs several
+            targets_left *= beam.size() * branching;
+
+            vector<Node> candidates;
+
+            for (auto &node : beam) {
+                bool expanded = false;
+                for (PackedCoord p : next_targets(node, branching)) {
+                    if (get_time() > deadline)
+                        break;
+                    auto goal = node.achieved;
+                    goal[p] = node.generation == 0 ?
+                        cell_to_cs(target[p]) : CS_ANY_BALL;
+
+                    SearchBudget budget(0);
+                    auto res = solve_target(
+                        node.board, goal, p, targets_left, budget);
+                    num_searches++;
+                    if (!res.first) {
+                        node.tried.insert(p);
+                        continue;
+                    }
+
+                    Node child = node;
+                    child.achieved[p] = goal[p];
+                    auto sol = res.second;
+                    reverse(sol.begin(), sol.end());
+                    for (auto move : sol) {
+                        move = reversed_move(move);
+                        apply_move(child.board, move);
+                        child.log = MoveLog::append(child.log, move);
+                        child.num_moves++;
+                    }
+                    child.score = placement_score(child.board, target, target_balls);
+                    if (child.num_moves > 20 * num_balls) {
+                        node.tried.insert(p);
+                        continue;
+                    }
+                    candidates.push_back(child);
+                    expanded = true;
+                }
+                // keep it around to try further targets next step
+                if (!expanded && !next_targets(node, 1).empty())
+                    candidates.push_back(node);
+                else if (!expanded)
+                    finished.push_back(node);
+            }
+
+            sort(candidates.begin(), candidates.end(),
+                [](const Node &a, const Node &b) {
+                    if (a.score != b.score)
+                        return a.score > b.score;
+                    return a.num_moves < b.num_moves;
+                });
+            beam.clear();
+            set<uint64_t> seen;
+            for (auto &node : candidates) {
+                if (beam.size() >= strategy.beam_width)
+                    break;
+                if (!seen.insert(board_hash(node.board)).second) {
+                    num_pruned++;
+                    continue;
+                }
+                beam.push_back(node);
+            }
+            num_steps++;
+            if (beam.empty())
+                break;
+            // candidates are sorted, so that's the best of this step
+            if (get_time() >= next_checkpoint)
+                save_checkpoint(
+                    beam.front().board, MoveLog::to_vector(beam.front().log.get()));
+        }
+
+        const Node *best = nullptr;
+        for (const auto *nodes : {&beam, &finished})
+            for (const auto &node : *nodes)
+                if (best == nullptr || node.score > best->score ||
+                    (node.score == best->score &&
+                     node.num_moves < best->num_moves))
+                    best = &node;
+        board = best->board;
+        moves = MoveLog::to_vector(best->log.get());
+        log << "num_steps = " << num_steps
+            << ", num_searches = " << num_searches
+            << ", num_pruned = " << num_pruned << endl;
+        finish();
+    }
+
+private:
+    struct Node {
+        Board board;
+        map<PackedCoord, CellSet> achieved;
+        // targets that failed in the current generation
+        set<PackedCoord> tried;
+        shared_ptr<const MoveLog> log;
+        int num_moves;
+        int generation;
+        double score;
+    };
+
+    // target cells, best first
+    vector<PackedCoord> order;
+    vector<Node> finished;
+
+    // Also switches the node to the any-ball generation when concrete
+    // targets run out.
+    vector<PackedCoord> next_targets(Node &node, int n) const {
+        vector<PackedCoord> result;
+        while (true) {
+            for (PackedCoord p : order) {
+                if (result.size() >= n)
+                    break;
+                if (node.achieved.count(p) == 0 && node.tried.count(p) == 0)
+                    result.push_back(p);
+            }
+            if (!result.empty() || node.generation > 0 ||
+                !strategy.any_ball_pass)
+                break;
+            node.generation++;
+            node.tried.clear();
+        }
+        return result;
+    }
+
+    int pending_count(const Node &node) const {
+        return order.size() - node.achieved.size() - node.tried.size();
+    }
+
+    static uint64_t board_hash(const Board &board) {
+        uint64_t h = 14695981039346656037ULL;  // FNV-1a
+        for (Cell c : board) {
+            h ^= (unsigned char)c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+};
+
+
+class RollingBalls {
+public:
+    vector<string> restorePattern(vector<string> raw_start, vector<string> raw_target) {
+#ifndef LOCAL
+        assert(false && "asserts should be disabled");
+#endif
+        double start_time = get_time();
+        for (int i = 0; i < 1000; i++)
+            get_time();
+        debug(get_time() - start_time);
+        PhaseReport phases;
+
+        debug(custom_knobs);
+        for (const auto &kv : custom_knobs) {
+            knobs.at(kv.first) = kv.second;
+        }
+        debug(knobs);
+
+        static const int profile = profile_tag("restore_pattern");
+        ProfileScope profile_scope(profile);
+
+        vector<string> result;
+
+        if (knobs.at("return_empty"))
+            return result;
+
+        if (knobs.at("profile_us") > 0)
+            start_profiler(knobs.at("profile_us"));
+
+        ::H = raw_start.size();
+        ::W = raw_start.front().size();
+        assert(raw_target.size() == ::H);
+        assert(raw_target.front().size() == ::W);
+
+        cerr << "# "; debug(W);
+        cerr << "# "; debug(H);
+
+        ::H += 2;
+        ::W += 2;
+        set_geometry(::W, ::H);
+
+        set<Cell> ball_colors;
+        int num_balls = 0;
+        int num_walls = 0;
+        Board start(::W * ::H, WALL);
+        Board target(::W * ::H, WALL);
+        for (int i = 1; i < ::H - 1; i++) {
+            for (int j = 1; j < ::W - 1; j++) {
+                start[pack(j, i)] = raw_start[i - 1][j - 1];
+                char c = target[pack(j, i)] = raw_target[i - 1][j - 1];
+
+                if (is_ball(c)) {
+                    num_balls++;
+                    ball_colors.insert(c);
+                } else if (c == WALL) {
+                    num_walls++;
+                }
+            }
+        }
+
+        cerr << "# "; debug(num_walls);
+        cerr << "# "; debug(num_balls);
+        int num_colors = ball_colors.size();
+        cerr << "# "; debug(num_colors);
+
+        int bucket =
+            (1.0 * num_walls / (W * H) - knobs.at("bucket_offset_pct") * 0.01) *
+            knobs.at("bucket_scale");
+        if (bucket > 2) bucket = 2;
+        phases.end("parse");
+
+        BallIndex target_balls(target);
+        // basin_score runs when the snapshot is rendered
+        draw_board([target, target_balls](ostream &out, PackedCoord p) {
+            if (target[p] == WALL) {
+                ansi_style(out, DEFAULT_COLOR, true);
+                out << "    ";
+                return;
+            }
+            if (is_ball(target[p]))
+                ansi_style(out, GREEN);
+            out << setw(4) << (int)basin_score(target, target_balls, p, {});
+
+        });
+
+        vector<Strategy> strategies = portfolio_strategies();
+        int num_threads = knobs.at("portfolio");
+        if (num_threads < 0)
+            num_threads = thread::hardware_concurrency();
+        num_threads = max(1, min<int>(num_threads, strategies.size()));
+        strategies.resize(num_threads);
+        cerr << "# "; debug(num_threads);
+        if (knobs.at("score_pipeline") < 0) {
+            // each greedy solver gets a pipeline thread of its own
+            int num_greedy = 0;
+            for (const auto &strategy : strategies)
+                num_greedy += strategy.beam_width == 0;
+            knobs.at("score_pipeline") =
+                num_threads + num_greedy <= thread::hardware_concurrency();
+        }
+
+        double deadline = start_time + knobs.at("time_limit_ms") * 1e-3;
+        vector<unique_ptr<Solver>> solvers;
+        for (const auto &strategy : strategies) {
+            if (strategy.beam_width > 0) {
+                solvers.emplace_back(
+                    new BeamSolver(start, target, strategy, deadline));
+            } else {
+                solvers.emplace_back(
+                    new GreedySolver(start, target, strategy, deadline, bucket));
+            }
+        }
+        phases.end("init");
+        if (solvers.size() == 1) {
+            solvers.front()->run();
+        } else {
+            vector<thread> threads;
+            int w = ::W;
+            int h = ::H;
+            for (auto &solver : solvers) {
+                Solver *s = solver.get();
+                threads.emplace_back([s, w, h]() {
+                    set_geometry(w, h);
+                    s->run();
+                });
+            }
+            for (auto &t : threads)
+                t.join();
+        }
+        phases.end("solve");
+
+        Solver *best = nullptr;
+        for (auto &solver : solvers) {
+            cerr << "--- " << solver->strategy.name << endl;
+            cerr << solver->log.str().c_str();
+            debug2(solver->score, solver->moves.size());
+            if (best == nullptr ||
+                solver->score > best->score ||
+                (solver->score == best->score &&
+                    solver->moves.size() < best->moves.size()))
+                best = solver.get();
+        }
+        string strategy = best->strategy.name;
+        cerr << "# "; debug(strategy);
+
+        for (auto move : best->moves)
+            result.push_back(format_move(move));
+        const Board &board = best->board;
 
         show_start_and_target(board, target);
 
@@ -1138,21 +4197,38 @@ public:
         int result_size = result.size();
         cerr << "# "; debug(result_size);
 
+        int moves_saved = best->moves_saved;
+        cerr << "# "; debug(moves_saved);
+        int num_checkpoints = best->num_checkpoints;
+        cerr << "# "; debug(num_checkpoints);
+        int64_t pipeline_hits = best->pipeline_hits;
+        cerr << "# "; debug(pipeline_hits);
+        int64_t pipeline_misses = best->pipeline_misses;
+        cerr << "# "; debug(pipeline_misses);
+        int num_routed = best->num_routed;
+        cerr << "# "; debug(num_routed);
+        int num_captured = subproblem_corpus.get_size();
+        cerr << "# "; debug(num_captured);
+
+        int failure_cache_size = best->failures.size();
+        cerr << "# "; debug(failure_cache_size);
+        int64_t failure_cache_hits = best->failures.hits;
+        cerr << "# "; debug(failure_cache_hits);
+
+        double node_rate = best->scheduler.node_rate();
+        cerr << "# "; debug(node_rate);
+        double branching = best->scheduler.branching();
+        cerr << "# "; debug(branching);
+
         debug(get_time_cnt);
+        phases.end("output");
+        report_memory();  // summed over all solvers
+        stop_profiler();
+        report_profile();
         double total_time = get_time() - start_time;
         cerr << "# "; debug(total_time);
 
-        double score = 0.0;
-        for (PackedCoord p = 0; p < board.size(); p++) {
-            if (is_ball(target[p])) {
-                if (board[p] == target[p])
-                    score += 1.0;
-                else if (is_ball(board[p]))
-                    score += 0.5;
-            }
-        }
-        if (num_balls > 0)
-            score /= num_balls;
+        double score = placement_score(board, target, target_balls);
         cerr << "# "; debug(score);
 
         if (result.size() > 20 * num_balls) {
@@ -1161,25 +4237,4 @@ public:
         }
         return result;
     }
-
-private:
-    static string format_move(Move move) {
-        int dir = move_dir(move);
-        if (dir == -::W) {
-            dir = 3;
-        } else if (dir == -1) {
-            dir = 0;
-        } else if (dir == 1) {
-            dir = 2;
-        } else if (dir == ::W) {
-            dir = 1;
-        } else {
-            assert(false);
-        }
-        ostringstream out;
-        out << unpack_y(move.first) - 1 << ' '
-            << unpack_x(move.first) - 1 << ' '
-            << dir;
-        return out.str();
-    }
 };
@@ -0,0 +1,165 @@
+"""
+Knob tuning by racing: samples random knob settings from SPACE (plus the
+defaults), evaluates them in parallel on a few seeds, keeps the better
+half and doubles the seeds until few are left. Prints the race and the
+Pareto front of mean score against mean time.
+
+    python3 tune.py [--configs 16] [--seeds 4] [--generated] ...
+
+By default seeds go through the tester (see run_many.py). With
+--generated, boards come from corpus.random_instance and the solver's own
+score metric is used, which doesn't need java. With --corpus FILE (see
+corpus.py), seed k runs instance k modulo the corpus size the same way.
+"""
+
+import argparse
+import json
+import multiprocessing
+import random
+import subprocess
+
+import corpus
+import run_many
+import scaling
+
+
+# candidate values for each knob (see knobs in solution.cpp)
+SPACE = {
+    'time_limit_ms': [2000, 4000, 7000],
+    'max_depth': [4, 5, 6, 7],
+    'budget_slack': [5, 10, 20],
+    'basin_samples': [4, 6, 10, 16],
+    'rescore_divisor': [3, 5, 8],
+    'rescore_divisor_walls': [5, 10, 15],
+    'bucket_offset_pct': [5, 10, 15],
+    'bucket_scale': [10, 15, 20],
+    'blocking_penalty': [0, 10, 20, 40],
+    'max_stages': [1, 2, 3],
+    'stage_candidates': [1, 2, 3],
+    'portfolio': [1],
+}
+
+
+def knob_args(config):
+    return ' '.join('{}={}'.format(k, v) for k, v in sorted(config.items()))
+
+
+def run_generated(command, seed):
+    board = corpus.random_instance(seed)
+    result = scaling.run_solution(command, seed, board, timeout=None)
+    return dict(
+        seed=str(seed), time=result['time'], score=result['score'])
+
+
+def run_corpus(command, path, seed):
+    index = seed % len(corpus.Corpus(path))
+    result = scaling.run_solution(
+        '{} --corpus={} --instance={}'.format(command, path, index),
+        seed, '', timeout=None)
+    return dict(
+        seed=str(seed), time=result['time'], score=result['score'])
+
+
+def evaluate(task):
+    config, seed, generated, corpus_path = task
+    command = './main ' + knob_args(config)
+    if corpus_path:
+        return run_corpus(command, corpus_path, seed)
+    if generated:
+        return run_generated(command, seed)
+    result = run_many.run_solution(command, seed)
+    return dict(seed=str(seed), time=result['time'], score=result['Score'])
+
+
+def pareto_front(points):
+    """points are (score, time, i); higher score and lower time is better."""
+    front = []
+    best_score = float('-inf')
+    for score, time, i in sorted(points, key=lambda p: (p[1], -p[0])):
+        if score > best_score:
+            front.append((score, time, i))
+            best_score = score
+    return front
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--configs', type=int, default=16)
+    parser.add_argument('--seeds', type=int, default=4, help='in first round')
+    parser.add_argument('--first_seed', type=int, default=1000)
+    parser.add_argument('--survivors', type=int, default=2)
+    parser.add_argument('--jobs', type=int, default=5)
+    parser.add_argument('--random_seed', type=int, default=0)
+    parser.add_argument('--generated', action='store_true')
+    parser.add_argument('--corpus', help='corpus.py file to take boards from')
+    parser.add_argument('--space', help='JSON to use instead of SPACE')
+    parser.add_argument('--out', help='write all results to this JSON file')
+    args = parser.parse_args()
+
+    space = SPACE if args.space is None else json.loads(args.space)
+    rnd = random.Random(args.random_seed)
+    # defaults, on one thread like the rest so that scores and times compare
+    configs = [{'portfolio': 1}]
+    while len(configs) < args.configs:
+        config = {k: rnd.choice(v) for k, v in sorted(space.items())}
+        if config not in configs:
+            configs.append(config)
+
+    subprocess.check_call(
+        'g++ --std=c++0x -W -Wall -Wno-sign-compare -Wno-unused '
+        '-DNDEBUG -DNO_DRAW_BOARDS '
+        '-O2 -s -pipe -mmmx -msse -msse2 -msse3 -pthread main.cpp -o main',
+        shell=True)
+
+    pool = multiprocessing.Pool(args.jobs)
+    results = [[] for _ in configs]  # per config, in seed order
+    alive = list(range(len(configs)))
+    num_seeds = args.seeds
+    round_number = 0
+
+    def mean(i, key, n=None):
+        rs = results[i][:n]
+        return sum(r[key] for r in rs) / len(rs)
+
+    while True:
+        tasks = []
+        owners = []
+        for i in alive:
+            for k in range(len(results[i]), num_seeds):
+                tasks.append((
+                    configs[i], args.first_seed + k, args.generated,
+                    args.corpus))
+                owners.append(i)
+        for i, result in zip(owners, pool.map(evaluate, tasks)):
+            results[i].append(result)
+
+        alive.sort(key=lambda i: -mean(i, 'score'))
+        print('round {}, {} seeds'.format(round_number, num_seeds))
+        for i in alive:
+            print('  #{:<3} score {:.4f}  time {:6.2f}  {}'.format(
+                i, mean(i, 'score'), mean(i, 'time'),
+                'defaults' if i == 0 else knob_args(configs[i])))
+        if len(alive) <= args.survivors:
+            break
+        alive = alive[:max(args.survivors, len(alive) // 2)]
+        num_seeds *= 2
+        round_number += 1
+
+    # all configs ran the first round's seeds
+    print('\nPareto front on the first {} seeds:'.format(args.seeds))
+    front = pareto_front([
+        (mean(i, 'score', args.seeds), mean(i, 'time', args.seeds), i)
+        for i in range(len(configs))])
+    for score, time, i in front:
+        print('  #{:<3} score {:.4f}  time {:6.2f}  {}'.format(
+            i, score, time, 'defaults' if i == 0 else knob_args(configs[i])))
+
+    if args.out:
+        with open(args.out, 'w') as fout:
+            json.dump(
+                [dict(config=c, results=r) for c, r in zip(configs, results)],
+                fout, indent=1)
+
+
+if __name__ == '__main__':
+    main()